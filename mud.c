@@ -18,6 +18,19 @@
 #include <netinet/in.h>
 #include <ifaddrs.h>
 
+#ifdef __linux__
+#include <netinet/udp.h>
+#include <linux/filter.h>
+#include <sys/epoll.h>
+#endif
+
+#include <pthread.h>
+#include <sched.h>
+
+#if defined MUD_IO_URING
+#include <liburing.h>
+#endif
+
 #include <sodium.h>
 
 #if defined IP_PKTINFO
@@ -40,20 +53,96 @@
 #define MUD_DFRAG_OPT IP_PMTUDISC_DO
 #endif
 
+#if defined __linux__ && defined UDP_SEGMENT
+#define MUD_GSO
+#endif
+
+#if defined __linux__ && defined UDP_GRO
+#define MUD_GRO
+#endif
+
+#if defined __linux__ && defined SO_REUSEPORT
+#define MUD_SHARD
+#endif
+
+#if defined __linux__
+#define MUD_CONNECT
+#endif
+
+#if defined __GNUC__
+#define MUD_POOL
+#endif
+
+#if defined crypto_aead_aegis128l_KEYBYTES && defined crypto_aead_aegis256_KEYBYTES
+#define MUD_AEGIS
+#endif
+
 #define MUD_ONE_MSEC (UINT64_C(1000))
 #define MUD_ONE_SEC  (1000*MUD_ONE_MSEC)
 #define MUD_ONE_MIN  (60*MUD_ONE_SEC)
 
 #define MUD_U48_SIZE (6U)
+#define MUD_SID_SIZE (4U)
 #define MUD_KEY_SIZE (32U)
 #define MUD_MAC_SIZE (16U)
 
+#define MUD_ETH_SIZE (14U)
+#define MUD_IP4_SIZE (20U)
+#define MUD_IP6_SIZE (40U)
+#define MUD_UDP_SIZE (8U)
+
+#define MUD_HEADER_MAX_SIZE  (MUD_U48_SIZE*2)
 #define MUD_PACKET_MIN_SIZE  (MUD_U48_SIZE+MUD_MAC_SIZE)
 #define MUD_PACKET_MAX_SIZE  (1500U)
 #define MUD_PACKET_SIZEOF(X) ((X)+MUD_PACKET_MIN_SIZE)
 
+#if (MUD_HEADROOM != MUD_SID_SIZE+MUD_HEADER_MAX_SIZE) || \
+    (MUD_TAILROOM != MUD_MAC_SIZE)
+#error "MUD_HEADROOM and MUD_TAILROOM do not match the packet format"
+#endif
+
+#if defined __GNUC__
+#define MUD_STAT(X)      __atomic_fetch_add(&(X), 1, __ATOMIC_RELAXED)
+#define MUD_ADD(X, N)    __atomic_fetch_add(&(X), (N), __ATOMIC_RELAXED)
+#define MUD_LOAD(X)      __atomic_load_n(&(X), __ATOMIC_RELAXED)
+#define MUD_STORE(X, V)  __atomic_store_n(&(X), (V), __ATOMIC_RELAXED)
+#define MUD_CAS(X, E, V) __atomic_compare_exchange_n(&(X), &(E), (V), 1, \
+                             __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#else
+#define MUD_STAT(X)      ((X)++)
+#define MUD_ADD(X, N)    (((X) += (N))-(N))
+#define MUD_LOAD(X)      (X)
+#define MUD_STORE(X, V)  ((X) = (V))
+#define MUD_CAS(X, E, V) (((X) = (V)), 1)
+#endif
+
+#define MUD_CACHELINE (64U)
+
+#if defined __GNUC__
+#define MUD_ALIGN __attribute__((aligned(MUD_CACHELINE)))
+#else
+#define MUD_ALIGN
+#endif
+
+#define MUD_BATCH_SIZE (32U)
+#define MUD_GRO_BATCH  (8U)
+#define MUD_GRO_SIZE   (65535U)
+#define MUD_URING_SIZE (256U)
+#define MUD_URING_RECV (UINT64_MAX)
+#define MUD_IO_SIZE    (256U)
+#define MUD_POOL_RING  (8U)
+#define MUD_POOL_MAX   (64U)
+#define MUD_POOL_SPIN  (1024U)
+#define MUD_KEYX_BATCH (8U)
+
 #define MUD_PONG_SIZE      MUD_PACKET_SIZEOF(MUD_U48_SIZE*4)
 #define MUD_PKEY_SIZE      (crypto_scalarmult_BYTES+1)
+#define MUD_PKEY_AES       (1U)
+#define MUD_PKEY_CTR       (1U<<1)
+#define MUD_PKEY_EPOCH     (1U<<2)
+#define MUD_PKEY_AEGIS128L (1U<<3)
+#define MUD_PKEY_AEGIS256  (1U<<4)
+#define MUD_PKEY_EXT       (1U<<7)
 #define MUD_KEYX_SIZE      MUD_PACKET_SIZEOF(MUD_U48_SIZE+2*MUD_PKEY_SIZE)
 #define MUD_MTUX_SIZE      MUD_PACKET_SIZEOF(MUD_U48_SIZE*2)
 #define MUD_BAKX_SIZE      MUD_PACKET_SIZEOF(MUD_U48_SIZE+1)
@@ -71,6 +160,13 @@ enum mud_msg {
     mud_bakx,
 };
 
+#if !defined __linux__
+struct mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned msg_len;
+};
+#endif
+
 struct ipaddr {
     int family;
     union {
@@ -89,12 +185,25 @@ struct path {
         unsigned char data[256];
         size_t size;
     } ctrl;
+    struct {
+        unsigned char data[MUD_ETH_SIZE];
+        size_t size;
+    } eth;
     struct {
         uint64_t send_time;
         int remote;
         int local;
     } bak;
     unsigned char *tc;
+    struct {
+        int fd;
+        int tc;
+    } conn;
+    uint64_t hash;
+    struct session *session;
+    struct path *next;
+    uint64_t recv_time MUD_ALIGN;
+    uint64_t pong_time;
     uint64_t rdt;
     uint64_t rtt;
     uint64_t sdt;
@@ -103,11 +212,8 @@ struct path {
     uint64_t r_rdt;
     uint64_t r_rst;
     int64_t r_dt;
+    uint64_t send_time MUD_ALIGN;
     uint64_t limit;
-    uint64_t recv_time;
-    uint64_t send_time;
-    uint64_t pong_time;
-    struct path *next;
 };
 
 struct public {
@@ -115,73 +221,384 @@ struct public {
     unsigned char recv[MUD_PKEY_SIZE];
 };
 
+struct uring_slot {
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage addr;
+    unsigned char ctrl[256];
+    unsigned char data[MUD_PACKET_MAX_SIZE];
+};
+
+struct io_slot {
+    struct sockaddr_storage addr;
+    struct sockaddr_storage local;
+    unsigned char ctrl[256];
+    size_t ctrl_size;
+    unsigned char data[MUD_PACKET_MAX_SIZE];
+    size_t size;
+};
+
+struct crypto_job {
+    struct session *session;
+    unsigned id;
+    unsigned char *src;
+    size_t src_size;
+    int ret;
+    int rotate;
+};
+
+struct rx {
+    struct mmsghdr msg[MUD_BATCH_SIZE];
+    struct iovec iov[MUD_BATCH_SIZE];
+    struct sockaddr_storage addr[MUD_BATCH_SIZE];
+    unsigned char ctrl[MUD_BATCH_SIZE][256];
+    unsigned char *data;
+    size_t size;
+    unsigned max;
+    unsigned count;
+    unsigned index;
+    size_t offset;
+    size_t segment;
+    struct ipaddr local_addr;
+    uint64_t now;
+    int view;
+    struct {
+        struct crypto_job data[MUD_BATCH_SIZE];
+        unsigned count;
+    } job;
+};
+
+struct sched {
+    struct path *path;
+    int64_t limit;
+    unsigned count;
+    int probe;
+};
+
+struct tx {
+    struct mmsghdr msg[MUD_BATCH_SIZE];
+    struct iovec iov[MUD_BATCH_SIZE];
+    unsigned char ctrl[MUD_BATCH_SIZE][256];
+    unsigned char data[MUD_BATCH_SIZE][MUD_PACKET_MAX_SIZE];
+    size_t size[MUD_BATCH_SIZE];
+    struct path *path[MUD_BATCH_SIZE];
+    unsigned index[MUD_BATCH_SIZE];
+    unsigned count[MUD_BATCH_SIZE];
+    struct {
+        struct sched *data;
+        size_t count;
+    } sched;
+};
+
+struct shard {
+    int fd;
+    struct rx rx MUD_ALIGN;
+    struct tx tx MUD_ALIGN;
+};
+
+struct pool_task {
+    void (*run)(void *, unsigned);
+    void *arg;
+    unsigned begin;
+    unsigned end;
+    unsigned *done;
+    uint64_t time;
+};
+
+struct pool_worker {
+    struct mud *mud;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned head;
+    struct pool_task ring[MUD_POOL_RING];
+    unsigned tail MUD_ALIGN;
+    int sleeping;
+};
+
 struct crypto_opt {
     unsigned char *dst;
     struct {
         const unsigned char *data;
         size_t size;
     } src, ad;
-    unsigned char npub[16];
+    unsigned char npub[32];
+};
+
+struct crypto_key;
+
+struct crypto_suite {
+    unsigned flag;
+    void (*init)(struct crypto_key *);
+    int (*encrypt)(const struct crypto_key *, const struct crypto_opt *);
+    int (*decrypt)(const struct crypto_key *, const struct crypto_opt *);
 };
 
 struct crypto_key {
     struct {
         unsigned char key[MUD_KEY_SIZE];
         crypto_aead_aes256gcm_state state;
+        unsigned char tag;
     } encrypt, decrypt;
-    int aes;
+    const struct crypto_suite *suite;
+    int ctr;
+    int epoch;
+    uint64_t nonce MUD_ALIGN;
 };
 
-struct mud {
-    int fd;
-    uint64_t send_timeout;
-    uint64_t time_tolerance;
+struct session {
+    unsigned id;
+    uint64_t hash;
     struct path *path;
+    struct {
+        uint64_t send_time;
+        int remote;
+    } mtu;
     struct {
         uint64_t recv_time;
         uint64_t send_time;
         unsigned char secret[crypto_scalarmult_SCALARBYTES];
         struct public public;
         struct crypto_key private, last, next, current;
+        struct {
+            unsigned char secret[crypto_scalarmult_SCALARBYTES];
+            unsigned char public[crypto_scalarmult_BYTES];
+            int ready;
+        } spare;
+        struct {
+            unsigned char secret[crypto_scalarmult_SCALARBYTES];
+            struct public public;
+            struct path *path;
+            uint64_t time;
+            unsigned seq;
+            int use_next;
+            int ready;
+        } pending;
         int use_next;
-        int aes;
         int bad_key;
+        uint64_t nonce MUD_ALIGN;
+    } crypto;
+};
+
+struct keyx_job {
+    struct session *session;
+    unsigned id;
+    unsigned seq;
+    int derive;
+    int spare;
+    int ret;
+    unsigned char secret[crypto_scalarmult_SCALARBYTES];
+    struct public public;
+    unsigned char psk[MUD_KEY_SIZE];
+    unsigned char spare_secret[crypto_scalarmult_SCALARBYTES];
+    unsigned char spare_public[crypto_scalarmult_BYTES];
+    struct crypto_key key;
+};
+
+struct mud {
+    int fd;
+    int port;
+    uint64_t send_timeout;
+    uint64_t time_tolerance;
+    int gso;
+    struct session *session;
+    struct {
+        struct session **slot;
+        size_t size;
+        size_t count;
+        int enabled;
+        int pending;
+        int cid;
+    } sessions;
+    struct {
+        struct path **slot;
+        size_t size;
+        size_t count;
+        unsigned char key[crypto_shorthash_KEYBYTES];
+    } index;
+    struct {
+        size_t max;
+        uint64_t idle;
+    } gc;
+    struct {
+        int aes;
+        int aegis;
+        int ctr;
+        int epoch;
     } crypto;
     struct {
-        uint64_t send_time;
-        int remote;
         int local;
     } mtu;
+    struct {
+        struct shard *data;
+        unsigned count;
+        pthread_rwlock_t lock;
+    } shard;
+    struct {
+        int enabled;
+        int epoll;
+    } conn;
+    struct {
+        uint64_t deadline;
+    } timer MUD_ALIGN;
+    struct {
+        struct pool_worker *worker;
+        unsigned count;
+        int busy;
+        int stop;
+    } pool;
+    struct {
+        struct keyx_job job[MUD_KEYX_BATCH];
+        unsigned count;
+        unsigned done;
+        int posted;
+        int busy;
+        int timers;
+    } keyx;
+    struct {
+        int enabled;
+        pthread_mutex_t mutex;
+        struct io_slot *slot;
+        unsigned head;
+        unsigned count;
+        unsigned lease;
+        uint64_t clock;
+    } io;
+    struct rx rx MUD_ALIGN;
+    struct {
+        uint64_t rate;
+        uint64_t tokens;
+        uint64_t time;
+    } filter;
+    struct mud_stats stats;
+    struct tx tx MUD_ALIGN;
+    struct {
+        int enabled;
+#if defined MUD_IO_URING
+        int armed;
+        struct io_uring ring;
+        struct io_uring_buf_ring *br;
+        struct msghdr msg;
+        struct sockaddr_storage addr;
+        unsigned char *data;
+        size_t size;
+        unsigned count;
+        struct uring_slot *slot;
+        unsigned *free;
+        unsigned free_count;
+        unsigned *lease;
+        unsigned lease_count;
+#endif
+    } uring;
 };
 
 static
-int mud_encrypt_opt (const struct crypto_key *k, const struct crypto_opt *c)
+int mud_chacha_encrypt (const struct crypto_key *k, const struct crypto_opt *c)
 {
-    if (k->aes) {
-        return crypto_aead_aes256gcm_encrypt_afternm(
-                    c->dst, NULL, c->src.data, c->src.size,
-                    c->ad.data, c->ad.size, NULL, c->npub,
-                    (const crypto_aead_aes256gcm_state *)&k->encrypt.state);
-    } else {
-        return crypto_aead_chacha20poly1305_encrypt(
-                    c->dst, NULL, c->src.data, c->src.size,
-                    c->ad.data, c->ad.size, NULL, c->npub, k->encrypt.key);
+    return crypto_aead_chacha20poly1305_encrypt(
+                c->dst, NULL, c->src.data, c->src.size,
+                c->ad.data, c->ad.size, NULL, c->npub, k->encrypt.key);
+}
+
+static
+int mud_chacha_decrypt (const struct crypto_key *k, const struct crypto_opt *c)
+{
+    return crypto_aead_chacha20poly1305_decrypt(
+                c->dst, NULL, NULL, c->src.data, c->src.size,
+                c->ad.data, c->ad.size, c->npub, k->decrypt.key);
+}
+
+static
+void mud_aes_init (struct crypto_key *k)
+{
+    crypto_aead_aes256gcm_beforenm(&k->encrypt.state, k->encrypt.key);
+    crypto_aead_aes256gcm_beforenm(&k->decrypt.state, k->decrypt.key);
+}
+
+static
+int mud_aes_encrypt (const struct crypto_key *k, const struct crypto_opt *c)
+{
+    return crypto_aead_aes256gcm_encrypt_afternm(
+                c->dst, NULL, c->src.data, c->src.size,
+                c->ad.data, c->ad.size, NULL, c->npub,
+                (const crypto_aead_aes256gcm_state *)&k->encrypt.state);
+}
+
+static
+int mud_aes_decrypt (const struct crypto_key *k, const struct crypto_opt *c)
+{
+    return crypto_aead_aes256gcm_decrypt_afternm(
+                c->dst, NULL, NULL, c->src.data, c->src.size,
+                c->ad.data, c->ad.size, c->npub,
+                (const crypto_aead_aes256gcm_state *)&k->decrypt.state);
+}
+
+#if defined MUD_AEGIS
+static
+int mud_aegis128l_encrypt (const struct crypto_key *k, const struct crypto_opt *c)
+{
+    return crypto_aead_aegis128l_encrypt(
+                c->dst, NULL, c->src.data, c->src.size,
+                c->ad.data, c->ad.size, NULL, c->npub, k->encrypt.key);
+}
+
+static
+int mud_aegis128l_decrypt (const struct crypto_key *k, const struct crypto_opt *c)
+{
+    return crypto_aead_aegis128l_decrypt(
+                c->dst, NULL, NULL, c->src.data, c->src.size,
+                c->ad.data, c->ad.size, c->npub, k->decrypt.key);
+}
+
+static
+int mud_aegis256_encrypt (const struct crypto_key *k, const struct crypto_opt *c)
+{
+    return crypto_aead_aegis256_encrypt(
+                c->dst, NULL, c->src.data, c->src.size,
+                c->ad.data, c->ad.size, NULL, c->npub, k->encrypt.key);
+}
+
+static
+int mud_aegis256_decrypt (const struct crypto_key *k, const struct crypto_opt *c)
+{
+    return crypto_aead_aegis256_decrypt(
+                c->dst, NULL, NULL, c->src.data, c->src.size,
+                c->ad.data, c->ad.size, c->npub, k->decrypt.key);
+}
+#endif
+
+static const struct crypto_suite mud_suites[] = {
+#if defined MUD_AEGIS
+    { MUD_PKEY_AEGIS128L, NULL, mud_aegis128l_encrypt, mud_aegis128l_decrypt },
+    { MUD_PKEY_AEGIS256,  NULL, mud_aegis256_encrypt,  mud_aegis256_decrypt  },
+#endif
+    { MUD_PKEY_AES,       mud_aes_init, mud_aes_encrypt, mud_aes_decrypt },
+    { 0,                  NULL, mud_chacha_encrypt, mud_chacha_decrypt },
+};
+
+static
+const struct crypto_suite *mud_suite (unsigned flags)
+{
+    size_t i;
+
+    for (i = 0; mud_suites[i].flag; i++) {
+        if (flags & mud_suites[i].flag)
+            break;
     }
+
+    return &mud_suites[i];
+}
+
+static
+int mud_encrypt_opt (const struct crypto_key *k, const struct crypto_opt *c)
+{
+    return k->suite->encrypt(k, c);
 }
 
 static
 int mud_decrypt_opt (const struct crypto_key *k, const struct crypto_opt *c)
 {
-    if (k->aes) {
-        return crypto_aead_aes256gcm_decrypt_afternm(
-                    c->dst, NULL, NULL, c->src.data, c->src.size,
-                    c->ad.data, c->ad.size, c->npub,
-                    (const crypto_aead_aes256gcm_state *)&k->decrypt.state);
-    } else {
-        return crypto_aead_chacha20poly1305_decrypt(
-                    c->dst, NULL, NULL, c->src.data, c->src.size,
-                    c->ad.data, c->ad.size, c->npub, k->decrypt.key);
-    }
+    return k->suite->decrypt(k, c);
 }
 
 static
@@ -207,956 +624,4858 @@ uint64_t mud_read48 (const unsigned char *src)
 }
 
 static
-uint64_t mud_now (struct mud *mud)
+void mud_write32 (unsigned char *dst, unsigned src)
 {
-    uint64_t now;
-#if defined CLOCK_REALTIME
-    struct timespec tv;
-    clock_gettime(CLOCK_REALTIME, &tv);
-    now = tv.tv_sec*MUD_ONE_SEC+tv.tv_nsec/MUD_ONE_MSEC;
-#else
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    now = tv.tv_sec*MUD_ONE_SEC+tv.tv_usec;
-#endif
-    return now&((UINT64_C(1)<<48)-1);
+    dst[0] = (unsigned char)(255U&(src));
+    dst[1] = (unsigned char)(255U&(src>>8));
+    dst[2] = (unsigned char)(255U&(src>>16));
+    dst[3] = (unsigned char)(255U&(src>>24));
 }
 
 static
-uint64_t mud_abs_diff (uint64_t a, uint64_t b)
+unsigned mud_read32 (const unsigned char *src)
 {
-    return (a >= b) ? a-b : b-a;
+    return ((unsigned)src[0])
+         | ((unsigned)src[1]<<8)
+         | ((unsigned)src[2]<<16)
+         | ((unsigned)src[3]<<24);
 }
 
 static
-int mud_timeout (uint64_t now, uint64_t last, uint64_t timeout)
+unsigned mud_read16 (const unsigned char *src)
 {
-    return ((!last) || ((now > last) && (now-last >= timeout)));
+    return ((unsigned)src[0]<<8)|(unsigned)src[1];
 }
 
 static
-void mud_unmapv4 (struct sockaddr *addr)
+void mud_write16 (unsigned char *dst, unsigned src)
 {
-    if (addr->sa_family != AF_INET6)
-        return;
-
-    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+    dst[0] = (unsigned char)(255U&(src>>8));
+    dst[1] = (unsigned char)(255U&(src));
+}
 
-    if (!IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
-        return;
+static
+uint32_t mud_csum (uint32_t sum, const unsigned char *data, size_t size)
+{
+    size_t i;
 
-    struct sockaddr_in sin = {
-        .sin_family = AF_INET,
-        .sin_port = sin6->sin6_port,
-    };
+    for (i = 0; i+1 < size; i += 2)
+        sum += mud_read16(&data[i]);
 
-    memcpy(&sin.sin_addr.s_addr,
-           &sin6->sin6_addr.s6_addr[12],
-           sizeof(sin.sin_addr.s_addr));
+    if (size&1)
+        sum += (uint32_t)data[size-1]<<8;
 
-    memcpy(addr, &sin, sizeof(sin));
+    return sum;
 }
 
 static
-size_t mud_addrlen (struct sockaddr_storage *addr)
+unsigned mud_csum_fold (uint32_t sum)
 {
-    return (addr->ss_family == AF_INET) ? sizeof(struct sockaddr_in)
-                                        : sizeof(struct sockaddr_in6);
+    while (sum>>16)
+        sum = (sum&0xFFFF)+(sum>>16);
+
+    return (~sum)&0xFFFF;
 }
 
 static
-int mud_addrinfo (struct sockaddr_storage *addr, const char *host, int port)
+void mud_lock (struct mud *mud, int exclusive)
 {
-    struct sockaddr_in sin = {
-        .sin_family = AF_INET,
-        .sin_port = htons(port),
-    };
-
-    if (inet_pton(AF_INET, host, &sin.sin_addr) == 1) {
-        memcpy(addr, &sin, sizeof(sin));
-        return 0;
-    }
-
-    struct sockaddr_in6 sin6 = {
-        .sin6_family = AF_INET6,
-        .sin6_port = htons(port),
-    };
+    if (mud->shard.count < 2)
+        return;
 
-    if (inet_pton(AF_INET6, host, &sin6.sin6_addr) == 1) {
-        memcpy(addr, &sin6, sizeof(sin6));
-        return 0;
+    if (exclusive) {
+        pthread_rwlock_wrlock(&mud->shard.lock);
+    } else {
+        pthread_rwlock_rdlock(&mud->shard.lock);
     }
-
-    errno = EINVAL;
-
-    return -1;
 }
 
 static
-ssize_t mud_send_path (struct mud *mud, struct path *path, uint64_t now,
-                       void *data, size_t size, int tc)
+void mud_unlock (struct mud *mud)
 {
-    if (!size)
-        return 0;
-
-    struct iovec iov = {
-        .iov_base = data,
-        .iov_len = size,
-    };
+    if (mud->shard.count > 1)
+        pthread_rwlock_unlock(&mud->shard.lock);
+}
 
-    struct msghdr msg = {
-        .msg_name = &path->addr,
-        .msg_namelen = mud_addrlen(&path->addr),
-        .msg_iov = &iov,
-        .msg_iovlen = 1,
-        .msg_control = path->ctrl.data,
-        .msg_controllen = path->ctrl.size,
-    };
+static
+void *mud_alloc (size_t size)
+{
+    void *ptr;
+    int err = posix_memalign(&ptr, MUD_CACHELINE, size);
 
-    if (path->tc)
-        memcpy(path->tc, &tc, sizeof(tc));
+    if (err) {
+        errno = err;
+        return NULL;
+    }
 
-    ssize_t ret = sendmsg(mud->fd, &msg, 0);
-    path->send_time = now;
+    memset(ptr, 0, size);
 
-    return ret;
+    return ptr;
 }
 
 static
-int mud_sso_int (int fd, int level, int optname, int opt)
+uint64_t mud_now (struct mud *mud)
 {
-    return setsockopt(fd, level, optname, &opt, sizeof(opt));
+    uint64_t now = MUD_LOAD(mud->io.clock);
+
+    if (now)
+        return now&((UINT64_C(1)<<48)-1);
+#if defined CLOCK_REALTIME
+    struct timespec tv;
+    clock_gettime(CLOCK_REALTIME, &tv);
+    now = tv.tv_sec*MUD_ONE_SEC+tv.tv_nsec/MUD_ONE_MSEC;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    now = tv.tv_sec*MUD_ONE_SEC+tv.tv_usec;
+#endif
+    return now&((UINT64_C(1)<<48)-1);
 }
 
 static
-int mud_cmp_ipaddr (struct ipaddr *a, struct ipaddr *b)
+uint64_t mud_clock (void)
 {
-    if (a == b)
+#if defined CLOCK_MONOTONIC
+    struct timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return (uint64_t)tv.tv_sec*UINT64_C(1000000000)+(uint64_t)tv.tv_nsec;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec*UINT64_C(1000000000)+(uint64_t)tv.tv_usec*1000;
+#endif
+}
+
+#if defined MUD_POOL
+static
+int mud_pool_wait (struct pool_worker *w, struct mud *mud)
+{
+    unsigned i;
+
+    for (i = 0; i < MUD_POOL_SPIN; i++) {
+        if (__atomic_load_n(&w->head, __ATOMIC_ACQUIRE) != w->tail)
+            return 0;
+
+        if (__atomic_load_n(&mud->pool.stop, __ATOMIC_ACQUIRE))
+            return 1;
+
+        sched_yield();
+    }
+
+    pthread_mutex_lock(&w->mutex);
+    __atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+
+    while ((__atomic_load_n(&w->head, __ATOMIC_SEQ_CST) == w->tail) &&
+           (!__atomic_load_n(&mud->pool.stop, __ATOMIC_SEQ_CST)))
+        pthread_cond_wait(&w->cond, &w->mutex);
+
+    __atomic_store_n(&w->sleeping, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&w->mutex);
+
+    return __atomic_load_n(&w->head, __ATOMIC_ACQUIRE) == w->tail;
+}
+
+static
+void *mud_pool_main (void *arg)
+{
+    struct pool_worker *w = (struct pool_worker *)arg;
+    struct mud *mud = w->mud;
+
+    while (!mud_pool_wait(w, mud)) {
+        struct pool_task *t = &w->ring[w->tail%MUD_POOL_RING];
+        uint64_t start = mud_clock();
+        unsigned *done = t->done;
+        unsigned i;
+
+        for (i = t->begin; i < t->end; i++)
+            t->run(t->arg, i);
+
+        uint64_t end = mud_clock();
+
+        MUD_ADD(mud->stats.pool_queue_ns, start-t->time);
+        MUD_ADD(mud->stats.pool_run_ns, end-start);
+
+        __atomic_store_n(&w->tail, w->tail+1, __ATOMIC_RELEASE);
+        __atomic_fetch_add(done, 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+static
+int mud_pool_push (struct pool_worker *w, struct pool_task task)
+{
+    unsigned head = w->head;
+
+    if (head != __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE))
+        return -1;
+
+    w->ring[head%MUD_POOL_RING] = task;
+    __atomic_store_n(&w->head, head+1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&w->mutex);
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&w->mutex);
+    }
+
+    return 0;
+}
+
+static
+void mud_pool_stop (struct mud *mud)
+{
+    if (!mud->pool.worker)
+        return;
+
+    __atomic_store_n(&mud->pool.stop, 1, __ATOMIC_SEQ_CST);
+
+    unsigned i;
+
+    for (i = 0; i < mud->pool.count; i++) {
+        struct pool_worker *w = &mud->pool.worker[i];
+
+        pthread_mutex_lock(&w->mutex);
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&w->mutex);
+
+        pthread_join(w->thread, NULL);
+        pthread_cond_destroy(&w->cond);
+        pthread_mutex_destroy(&w->mutex);
+    }
+
+    free(mud->pool.worker);
+
+    mud->pool.worker = NULL;
+    mud->pool.count = 0;
+    mud->pool.stop = 0;
+}
+#endif
+
+static
+void mud_pool_run (struct mud *mud, void (*run)(void *, unsigned),
+                   void *arg, unsigned count)
+{
+    unsigned i = 0;
+#if defined MUD_POOL
+    unsigned n = mud->pool.count;
+
+    if ((n) && (count > 1) &&
+        (!__atomic_exchange_n(&mud->pool.busy, 1, __ATOMIC_ACQUIRE))) {
+        unsigned chunks = (n < count) ? n+1 : count;
+        unsigned done = 0;
+        unsigned tasks = 0;
+        uint64_t now = mud_clock();
+
+        for (; tasks+1 < chunks; tasks++) {
+            struct pool_task task = {
+                .run = run,
+                .arg = arg,
+                .begin = (tasks+1)*count/chunks,
+                .end = (tasks+2)*count/chunks,
+                .done = &done,
+                .time = now,
+            };
+
+            if (mud_pool_push(&mud->pool.worker[tasks], task))
+                break;
+        }
+
+        for (; i < count/chunks; i++)
+            run(arg, i);
+
+        for (i = (tasks+1)*count/chunks; i < count; i++)
+            run(arg, i);
+
+        uint64_t wait = mud_clock();
+
+        while (__atomic_load_n(&done, __ATOMIC_ACQUIRE) != tasks)
+            sched_yield();
+
+        MUD_ADD(mud->stats.pool_wait_ns, mud_clock()-wait);
+        MUD_ADD(mud->stats.pool_tasks, tasks);
+
+        __atomic_store_n(&mud->pool.busy, 0, __ATOMIC_RELEASE);
+        return;
+    }
+#endif
+    for (; i < count; i++)
+        run(arg, i);
+}
+
+static
+int mud_pool_post (struct mud *mud, void (*run)(void *, unsigned),
+                   void *arg, unsigned count, unsigned *done)
+{
+#if defined MUD_POOL
+    unsigned n = mud->pool.count;
+
+    if ((!n) || (__atomic_exchange_n(&mud->pool.busy, 1, __ATOMIC_ACQUIRE)))
         return 0;
 
-    if (a->family != b->family)
-        return 1;
+    struct pool_task task = {
+        .run = run,
+        .arg = arg,
+        .end = count,
+        .done = done,
+        .time = mud_clock(),
+    };
 
-    if (a->family == AF_INET)
-        return memcmp(&a->ip.v4, &b->ip.v4, sizeof(a->ip.v4));
+    int ret = !mud_pool_push(&mud->pool.worker[n-1], task);
 
-    if (a->family == AF_INET6)
-        return memcmp(&a->ip.v6, &b->ip.v6, sizeof(a->ip.v6));
+    if (ret)
+        MUD_STAT(mud->stats.pool_tasks);
 
-    return 1;
+    __atomic_store_n(&mud->pool.busy, 0, __ATOMIC_RELEASE);
+
+    return ret;
+#else
+    (void)mud;
+    (void)run;
+    (void)arg;
+    (void)count;
+    (void)done;
+
+    return 0;
+#endif
 }
 
 static
-int mud_cmp_addr (struct sockaddr *a, struct sockaddr *b)
+uint64_t mud_abs_diff (uint64_t a, uint64_t b)
 {
-    if (a == b)
+    return (a >= b) ? a-b : b-a;
+}
+
+static
+int mud_timeout (uint64_t now, uint64_t last, uint64_t timeout)
+{
+    return ((!last) || ((now > last) && (now-last >= timeout)));
+}
+
+static
+void mud_unmapv4 (struct sockaddr *addr)
+{
+    if (addr->sa_family != AF_INET6)
+        return;
+
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+
+    if (!IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+        return;
+
+    struct sockaddr_in sin = {
+        .sin_family = AF_INET,
+        .sin_port = sin6->sin6_port,
+    };
+
+    memcpy(&sin.sin_addr.s_addr,
+           &sin6->sin6_addr.s6_addr[12],
+           sizeof(sin.sin_addr.s_addr));
+
+    memcpy(addr, &sin, sizeof(sin));
+}
+
+static
+size_t mud_addrlen (struct sockaddr_storage *addr)
+{
+    return (addr->ss_family == AF_INET) ? sizeof(struct sockaddr_in)
+                                        : sizeof(struct sockaddr_in6);
+}
+
+static
+int mud_addrinfo (struct sockaddr_storage *addr, const char *host, int port)
+{
+    struct sockaddr_in sin = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+    };
+
+    if (inet_pton(AF_INET, host, &sin.sin_addr) == 1) {
+        memcpy(addr, &sin, sizeof(sin));
         return 0;
+    }
 
-    if (a->sa_family != b->sa_family)
-        return 1;
+    struct sockaddr_in6 sin6 = {
+        .sin6_family = AF_INET6,
+        .sin6_port = htons(port),
+    };
 
-    if (a->sa_family == AF_INET) {
-        struct sockaddr_in *_a = (struct sockaddr_in *)a;
-        struct sockaddr_in *_b = (struct sockaddr_in *)b;
+    if (inet_pton(AF_INET6, host, &sin6.sin6_addr) == 1) {
+        memcpy(addr, &sin6, sizeof(sin6));
+        return 0;
+    }
 
-        return ((_a->sin_port != _b->sin_port) ||
-                (memcmp(&_a->sin_addr, &_b->sin_addr,
-                        sizeof(_a->sin_addr))));
+    errno = EINVAL;
+
+    return -1;
+}
+
+static
+int mud_recvmmsg (int fd, struct mmsghdr *msg, unsigned count, int flags)
+{
+#if defined __linux__
+    return recvmmsg(fd, msg, count, flags|MSG_WAITFORONE, NULL);
+#else
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        ssize_t ret = recvmsg(fd, &msg[i].msg_hdr, i ? MSG_DONTWAIT : flags);
+
+        if (ret == -1)
+            break;
+
+        msg[i].msg_len = (unsigned)ret;
     }
 
-    if (a->sa_family == AF_INET6) {
-        struct sockaddr_in6 *_a = (struct sockaddr_in6 *)a;
-        struct sockaddr_in6 *_b = (struct sockaddr_in6 *)b;
+    return i ? (int)i : -1;
+#endif
+}
 
-        return ((_a->sin6_port != _b->sin6_port) ||
-                (memcmp(&_a->sin6_addr, &_b->sin6_addr,
-                        sizeof(_a->sin6_addr))));
+#if defined MUD_IO_URING
+static
+void mud_uring_recycle (struct mud *mud, unsigned bid)
+{
+    io_uring_buf_ring_add(mud->uring.br, mud->uring.data+bid*mud->uring.size,
+                          (unsigned)mud->uring.size, (unsigned short)bid,
+                          io_uring_buf_ring_mask(mud->uring.count), 0);
+    io_uring_buf_ring_advance(mud->uring.br, 1);
+}
+
+static
+void mud_uring_reap (struct mud *mud)
+{
+    struct io_uring_cqe *cqe;
+
+    while (!io_uring_peek_cqe(&mud->uring.ring, &cqe)) {
+        uint64_t data = io_uring_cqe_get_data64(cqe);
+
+        if (data == MUD_URING_RECV)
+            break;
+
+        mud->uring.free[mud->uring.free_count++] = (unsigned)data;
+        io_uring_cqe_seen(&mud->uring.ring, cqe);
     }
+}
 
-    return 1;
+static
+struct io_uring_sqe *mud_uring_sqe (struct mud *mud)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&mud->uring.ring);
+
+    if (!sqe) {
+        io_uring_submit(&mud->uring.ring);
+        sqe = io_uring_get_sqe(&mud->uring.ring);
+    }
+
+    return sqe;
 }
 
 static
-void mud_set_path (struct path *path, struct ipaddr *local_addr,
-                   struct sockaddr *addr)
+int mud_uring_arm (struct mud *mud)
 {
-    struct msghdr msg = {
-        .msg_control = path->ctrl.data,
-        .msg_controllen = sizeof(path->ctrl.data),
+    struct io_uring_sqe *sqe = mud_uring_sqe(mud);
+
+    if (!sqe)
+        return -1;
+
+    io_uring_prep_recvmsg_multishot(sqe, mud->fd, &mud->uring.msg, 0);
+    io_uring_sqe_set_data64(sqe, MUD_URING_RECV);
+
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+
+    mud->uring.armed = 1;
+
+    return 0;
+}
+
+static
+ssize_t mud_uring_sendmsg (struct mud *mud, struct msghdr *msg)
+{
+    if (!mud->uring.free_count)
+        mud_uring_reap(mud);
+
+    if ((!mud->uring.free_count) ||
+        (msg->msg_namelen > sizeof(struct sockaddr_storage)) ||
+        (msg->msg_controllen > sizeof(mud->uring.slot->ctrl)))
+        return -1;
+
+    size_t size = 0;
+    size_t i;
+
+    for (i = 0; i < msg->msg_iovlen; i++)
+        size += msg->msg_iov[i].iov_len;
+
+    if (size > sizeof(mud->uring.slot->data))
+        return -1;
+
+    struct io_uring_sqe *sqe = mud_uring_sqe(mud);
+
+    if (!sqe)
+        return -1;
+
+    unsigned index = mud->uring.free[--mud->uring.free_count];
+    struct uring_slot *slot = &mud->uring.slot[index];
+
+    for (size = 0, i = 0; i < msg->msg_iovlen; i++) {
+        memcpy(slot->data+size, msg->msg_iov[i].iov_base,
+               msg->msg_iov[i].iov_len);
+        size += msg->msg_iov[i].iov_len;
+    }
+
+    memcpy(&slot->addr, msg->msg_name, msg->msg_namelen);
+    memcpy(slot->ctrl, msg->msg_control, msg->msg_controllen);
+
+    slot->iov.iov_base = slot->data;
+    slot->iov.iov_len = size;
+
+    slot->msg = (struct msghdr) {
+        .msg_name = &slot->addr,
+        .msg_namelen = msg->msg_namelen,
+        .msg_iov = &slot->iov,
+        .msg_iovlen = 1,
+        .msg_control = slot->ctrl,
+        .msg_controllen = msg->msg_controllen,
     };
 
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    io_uring_prep_sendmsg(sqe, mud->fd, &slot->msg, 0);
+    io_uring_sqe_set_data64(sqe, index);
 
-    memset(path->ctrl.data, 0, sizeof(path->ctrl.data));
-    memmove(&path->local_addr, local_addr, sizeof(struct ipaddr));
+    return (ssize_t)size;
+}
+#endif
 
-    if (addr->sa_family == AF_INET) {
-        memmove(&path->addr, addr, sizeof(struct sockaddr_in));
+static
+void mud_ipaddr_sockaddr (struct sockaddr_storage *addr,
+                          struct ipaddr *ipaddr, int port)
+{
+    memset(addr, 0, sizeof(*addr));
+
+    if (ipaddr->family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        memcpy(&sin->sin_addr, &ipaddr->ip.v4, sizeof(sin->sin_addr));
+    } else if (ipaddr->family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        memcpy(&sin6->sin6_addr, &ipaddr->ip.v6, sizeof(sin6->sin6_addr));
+    }
+}
 
-        cmsg->cmsg_level = IPPROTO_IP;
-        cmsg->cmsg_type = MUD_PKTINFO;
-        cmsg->cmsg_len = CMSG_LEN(MUD_PKTINFO_SIZE);
+static
+ssize_t mud_io_sendmsg (struct mud *mud, struct path *path, struct msghdr *msg)
+{
+    size_t size = 0;
+    size_t i;
 
-        memcpy(MUD_PKTINFO_DST(CMSG_DATA(cmsg)),
-               &local_addr->ip.v4,
-               sizeof(struct in_addr));
+    for (i = 0; i < msg->msg_iovlen; i++)
+        size += msg->msg_iov[i].iov_len;
 
-        cmsg = CMSG_NXTHDR(&msg, cmsg);
+    if ((size > sizeof(mud->io.slot->data)) ||
+        (msg->msg_controllen > sizeof(mud->io.slot->ctrl))) {
+        errno = EMSGSIZE;
+        return -1;
+    }
 
-        cmsg->cmsg_level = IPPROTO_IP;
-        cmsg->cmsg_type = IP_TOS;
-        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    pthread_mutex_lock(&mud->io.mutex);
+
+    if (mud->io.count+mud->io.lease >= MUD_IO_SIZE) {
+        pthread_mutex_unlock(&mud->io.mutex);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    unsigned index = (mud->io.head+mud->io.count)%MUD_IO_SIZE;
+    struct io_slot *slot = &mud->io.slot[index];
+
+    for (size = 0, i = 0; i < msg->msg_iovlen; i++) {
+        memcpy(slot->data+size, msg->msg_iov[i].iov_base,
+               msg->msg_iov[i].iov_len);
+        size += msg->msg_iov[i].iov_len;
+    }
+
+    slot->size = size;
+    slot->ctrl_size = msg->msg_controllen;
+
+    if (slot->ctrl_size)
+        memcpy(slot->ctrl, msg->msg_control, slot->ctrl_size);
+
+    memcpy(&slot->addr, &path->addr, sizeof(slot->addr));
+    mud_ipaddr_sockaddr(&slot->local, &path->local_addr, mud->port);
+
+    mud->io.count++;
+
+    pthread_mutex_unlock(&mud->io.mutex);
+
+    return (ssize_t)size;
+}
+
+static
+ssize_t mud_sendmsg (struct mud *mud, int fd, struct path *path,
+                     struct msghdr *msg)
+{
+    if (mud->io.enabled)
+        return mud_io_sendmsg(mud, path, msg);
+
+#if defined MUD_IO_URING
+    if ((mud->uring.enabled) && (fd == mud->fd)) {
+        ssize_t ret = mud_uring_sendmsg(mud, msg);
+
+        if (ret != -1)
+            return ret;
+    }
+#endif
+    return sendmsg(fd, msg, 0);
+}
+
+static
+int mud_sendmmsg (struct mud *mud, int fd, struct path *path,
+                  struct mmsghdr *msg, unsigned count)
+{
+#if defined __linux__
+    if (((!mud->uring.enabled) && (!mud->io.enabled)) || (fd != mud->fd))
+        return sendmmsg(fd, msg, count, 0);
+#endif
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        ssize_t ret = mud_sendmsg(mud, fd, path, &msg[i].msg_hdr);
+
+        if (ret == -1)
+            break;
+
+        msg[i].msg_len = (unsigned)ret;
+    }
+
+    return i ? (int)i : -1;
+}
+
+static
+void mud_flush (struct mud *mud)
+{
+#if defined MUD_IO_URING
+    if (mud->uring.enabled)
+        io_uring_submit(&mud->uring.ring);
+#else
+    (void)mud;
+#endif
+}
+
+static
+size_t mud_conn_ctrl (struct path *path, unsigned char *ctrl, int tc)
+{
+    if (tc == path->conn.tc)
+        return 0;
+
+    struct cmsghdr *cmsg = (struct cmsghdr *)ctrl;
+
+    memset(cmsg, 0, CMSG_SPACE(sizeof(int)));
+
+    if (path->addr.ss_family == AF_INET) {
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = IP_TOS;
+    } else {
+        cmsg->cmsg_level = IPPROTO_IPV6;
+        cmsg->cmsg_type = IPV6_TCLASS;
+    }
+
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &tc, sizeof(int));
+
+    return CMSG_SPACE(sizeof(int));
+}
+
+static
+ssize_t mud_send_path (struct mud *mud, struct path *path, uint64_t now,
+                       void *data, size_t size, int tc)
+{
+    if (!size)
+        return 0;
+
+    struct iovec iov = {
+        .iov_base = data,
+        .iov_len = size,
+    };
+
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+
+    int fd = path->conn.fd;
+    unsigned char ctrl[sizeof(path->ctrl.data)];
+
+    if (fd == -1) {
+        fd = mud->fd;
+        msg.msg_name = &path->addr;
+        msg.msg_namelen = mud_addrlen(&path->addr);
+        msg.msg_control = ctrl;
+        msg.msg_controllen = path->ctrl.size;
+
+        memcpy(ctrl, path->ctrl.data, path->ctrl.size);
+
+        if (path->tc)
+            memcpy(ctrl+(path->tc-path->ctrl.data), &tc, sizeof(tc));
+    } else {
+        msg.msg_controllen = mud_conn_ctrl(path, ctrl, tc);
+
+        if (msg.msg_controllen)
+            msg.msg_control = ctrl;
+    }
+
+    ssize_t ret = mud_sendmsg(mud, fd, path, &msg);
+    MUD_STORE(path->send_time, now);
+
+    return ret;
+}
+
+static
+int mud_sso_int (int fd, int level, int optname, int opt)
+{
+    return setsockopt(fd, level, optname, &opt, sizeof(opt));
+}
+
+static
+int mud_setup_socket (int fd, int v4, int v6, int shard)
+{
+#if defined MUD_SHARD
+    if (shard && mud_sso_int(fd, SOL_SOCKET, SO_REUSEPORT, 1))
+        return -1;
+#endif
+
+    if ((mud_sso_int(fd, SOL_SOCKET, SO_REUSEADDR, 1)) ||
+        (v4 && mud_sso_int(fd, IPPROTO_IP, MUD_PKTINFO, 1)) ||
+        (v6 && mud_sso_int(fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, 1)) ||
+        (v6 && mud_sso_int(fd, IPPROTO_IPV6, IPV6_V6ONLY, !v4)))
+        return -1;
+
+#ifdef __linux__
+        if (v4)
+            mud_sso_int(fd, IPPROTO_IP, MUD_DFRAG, MUD_DFRAG_OPT);
+#endif
+
+//  mud_sso_int(fd, SOL_SOCKET, SO_RCVBUF, 1<<24);
+//  mud_sso_int(fd, SOL_SOCKET, SO_SNDBUF, 1<<24);
+
+    return 0;
+}
+
+static
+int mud_cmp_ipaddr (struct ipaddr *a, struct ipaddr *b)
+{
+    if (a == b)
+        return 0;
+
+    if (a->family != b->family)
+        return 1;
+
+    if (a->family == AF_INET)
+        return memcmp(&a->ip.v4, &b->ip.v4, sizeof(a->ip.v4));
+
+    if (a->family == AF_INET6)
+        return memcmp(&a->ip.v6, &b->ip.v6, sizeof(a->ip.v6));
+
+    return 1;
+}
+
+static
+int mud_cmp_addr (struct sockaddr *a, struct sockaddr *b)
+{
+    if (a == b)
+        return 0;
+
+    if (a->sa_family != b->sa_family)
+        return 1;
+
+    if (a->sa_family == AF_INET) {
+        struct sockaddr_in *_a = (struct sockaddr_in *)a;
+        struct sockaddr_in *_b = (struct sockaddr_in *)b;
+
+        return ((_a->sin_port != _b->sin_port) ||
+                (memcmp(&_a->sin_addr, &_b->sin_addr,
+                        sizeof(_a->sin_addr))));
+    }
+
+    if (a->sa_family == AF_INET6) {
+        struct sockaddr_in6 *_a = (struct sockaddr_in6 *)a;
+        struct sockaddr_in6 *_b = (struct sockaddr_in6 *)b;
+
+        return ((_a->sin6_port != _b->sin6_port) ||
+                (memcmp(&_a->sin6_addr, &_b->sin6_addr,
+                        sizeof(_a->sin6_addr))));
+    }
+
+    return 1;
+}
+
+static
+int mud_cmp_host (struct sockaddr *a, struct sockaddr *b)
+{
+    if (a->sa_family != b->sa_family)
+        return 1;
+
+    if (a->sa_family == AF_INET)
+        return memcmp(&((struct sockaddr_in *)a)->sin_addr,
+                      &((struct sockaddr_in *)b)->sin_addr,
+                      sizeof(struct in_addr));
+
+    if (a->sa_family == AF_INET6)
+        return memcmp(&((struct sockaddr_in6 *)a)->sin6_addr,
+                      &((struct sockaddr_in6 *)b)->sin6_addr,
+                      sizeof(struct in6_addr));
+
+    return 1;
+}
+
+static
+void mud_set_path (struct path *path, struct ipaddr *local_addr,
+                   struct sockaddr *addr)
+{
+    struct msghdr msg = {
+        .msg_control = path->ctrl.data,
+        .msg_controllen = sizeof(path->ctrl.data),
+    };
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    memset(path->ctrl.data, 0, sizeof(path->ctrl.data));
+    memmove(&path->local_addr, local_addr, sizeof(struct ipaddr));
+
+    if (addr->sa_family == AF_INET) {
+        memmove(&path->addr, addr, sizeof(struct sockaddr_in));
+
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = MUD_PKTINFO;
+        cmsg->cmsg_len = CMSG_LEN(MUD_PKTINFO_SIZE);
+
+        memcpy(MUD_PKTINFO_DST(CMSG_DATA(cmsg)),
+               &local_addr->ip.v4,
+               sizeof(struct in_addr));
+
+        cmsg = CMSG_NXTHDR(&msg, cmsg);
+
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = IP_TOS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+
+        path->tc = CMSG_DATA(cmsg);
+        path->ctrl.size = CMSG_SPACE(MUD_PKTINFO_SIZE)
+                        + CMSG_SPACE(sizeof(int));
+    }
+
+    if (addr->sa_family == AF_INET6) {
+        memmove(&path->addr, addr, sizeof(struct sockaddr_in6));
+
+        cmsg->cmsg_level = IPPROTO_IPV6;
+        cmsg->cmsg_type = IPV6_PKTINFO;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
+
+        memcpy(&((struct in6_pktinfo *)CMSG_DATA(cmsg))->ipi6_addr,
+               &local_addr->ip.v6,
+               sizeof(struct in6_addr));
+
+        cmsg = CMSG_NXTHDR(&msg, cmsg);
+
+        cmsg->cmsg_level = IPPROTO_IPV6;
+        cmsg->cmsg_type = IPV6_TCLASS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+
+        path->tc = CMSG_DATA(cmsg);
+        path->ctrl.size = CMSG_SPACE(sizeof(struct in6_pktinfo))
+                        + CMSG_SPACE(sizeof(int));
+    }
+}
+
+#if defined MUD_CONNECT
+static
+void mud_path_close (struct path *path)
+{
+    if (path->conn.fd == -1)
+        return;
+
+    int err = errno;
+    close(path->conn.fd);
+    errno = err;
+
+    path->conn.fd = -1;
+    path->conn.tc = 0;
+}
+
+static
+void mud_path_connect (struct mud *mud, struct path *path)
+{
+    struct sockaddr_storage addr;
+    int v4 = path->addr.ss_family == AF_INET;
+
+    memset(&addr, 0, sizeof(addr));
+
+    if (v4) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons((uint16_t)mud->port);
+        sin->sin_addr = path->local_addr.ip.v4;
+    } else {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&addr;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons((uint16_t)mud->port);
+        sin6->sin6_addr = path->local_addr.ip.v6;
+    }
+
+    path->conn.fd = socket(path->addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+
+    if (path->conn.fd == -1)
+        return;
+
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.fd = path->conn.fd,
+    };
+
+    if (mud_setup_socket(path->conn.fd, v4, !v4, 0) ||
+        bind(path->conn.fd, (struct sockaddr *)&addr, mud_addrlen(&addr)) ||
+        connect(path->conn.fd, (struct sockaddr *)&path->addr,
+                mud_addrlen(&path->addr)) ||
+        epoll_ctl(mud->conn.epoll, EPOLL_CTL_ADD, path->conn.fd, &ev)) {
+        mud_path_close(path);
+        return;
+    }
+
+#if defined MUD_GRO
+    if (mud->rx.size > MUD_PACKET_MAX_SIZE)
+        mud_sso_int(path->conn.fd, IPPROTO_UDP, UDP_GRO, 1);
+#endif
+}
+#endif
+
+static
+uint64_t mud_path_hash (struct mud *mud, struct ipaddr *local_addr,
+                        struct sockaddr *addr)
+{
+    unsigned char buf[2*sizeof(struct in6_addr)+2];
+    unsigned char hash[crypto_shorthash_BYTES];
+    size_t size = 0;
+
+    if (addr->sa_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+
+        memcpy(buf, &local_addr->ip.v4, sizeof(struct in_addr));
+        memcpy(&buf[4], &sin->sin_addr, sizeof(struct in_addr));
+        memcpy(&buf[8], &sin->sin_port, 2);
+        size = 10;
+    } else if (addr->sa_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+
+        memcpy(buf, &local_addr->ip.v6, sizeof(struct in6_addr));
+        memcpy(&buf[16], &sin6->sin6_addr, sizeof(struct in6_addr));
+        memcpy(&buf[32], &sin6->sin6_port, 2);
+        size = 34;
+    }
+
+    crypto_shorthash(hash, buf, size, mud->index.key);
+
+    uint64_t ret;
+    memcpy(&ret, hash, sizeof(ret));
+
+    return ret;
+}
+
+static
+void mud_path_insert (struct mud *mud, struct path *path)
+{
+    size_t mask = mud->index.size-1;
+    size_t i = (size_t)path->hash&mask;
+
+    while (mud->index.slot[i])
+        i = (i+1)&mask;
+
+    mud->index.slot[i] = path;
+    mud->index.count++;
+}
+
+static
+int mud_tx_reserve (struct tx *tx, size_t size)
+{
+    struct sched *data = realloc(tx->sched.data, size*sizeof(struct sched));
+
+    if (!data)
+        return -1;
+
+    tx->sched.data = data;
+
+    return 0;
+}
+
+static
+int mud_path_reserve (struct mud *mud)
+{
+    if (2*(mud->index.count+1) <= mud->index.size)
+        return 0;
+
+    size_t size = mud->index.size ? 2*mud->index.size : 16;
+
+    if (mud_tx_reserve(&mud->tx, size))
+        return -1;
+
+    unsigned k;
+
+    for (k = 1; k < mud->shard.count; k++) {
+        if (mud_tx_reserve(&mud->shard.data[k-1].tx, size))
+            return -1;
+    }
+
+    struct path **slot = calloc(size, sizeof(struct path *));
+
+    if (!slot)
+        return -1;
+
+    free(mud->index.slot);
+
+    mud->index.slot = slot;
+    mud->index.size = size;
+    mud->index.count = 0;
+
+    size_t i;
+
+    for (i = 0; i < mud->sessions.size; i++) {
+        struct session *session = mud->sessions.slot[i];
+        struct path *path;
+
+        if (!session)
+            continue;
+
+        for (path = session->path; path; path = path->next)
+            mud_path_insert(mud, path);
+    }
+
+    return 0;
+}
+
+static
+void mud_path_remove (struct mud *mud, struct path *path)
+{
+    size_t mask = mud->index.size-1;
+    size_t i = (size_t)path->hash&mask;
+    size_t j;
+
+    while (mud->index.slot[i] != path)
+        i = (i+1)&mask;
+
+    for (j = (i+1)&mask; mud->index.slot[j]; j = (j+1)&mask) {
+        size_t k = (size_t)mud->index.slot[j]->hash&mask;
+
+        if ((j > i) ? ((k <= i) || (k > j)) : ((k <= i) && (k > j))) {
+            mud->index.slot[i] = mud->index.slot[j];
+            i = j;
+        }
+    }
+
+    mud->index.slot[i] = NULL;
+    mud->index.count--;
+
+    if (path->session->crypto.pending.path == path)
+        path->session->crypto.pending.path = NULL;
+
+#if defined MUD_CONNECT
+    mud_path_close(path);
+#endif
+
+    free(path);
+}
+
+static
+void mud_path_unlink (struct mud *mud, struct path *path)
+{
+    struct path **next = &path->session->path;
+
+    while (*next != path)
+        next = &(*next)->next;
+
+    *next = path->next;
+    mud_path_remove(mud, path);
+}
+
+static
+void mud_path_gc (struct mud *mud, struct session *session, uint64_t now)
+{
+    if (!mud->gc.idle)
+        return;
+
+    struct path **next = &session->path;
+
+    while (*next) {
+        struct path *path = *next;
+
+        if ((path->state.active) ||
+            (!mud_timeout(now, path->recv_time, mud->gc.idle))) {
+            next = &path->next;
+            continue;
+        }
+
+        *next = path->next;
+        mud_path_remove(mud, path);
+        MUD_STAT(mud->stats.path_expired);
+    }
+}
+
+static
+int mud_path_evict (struct mud *mud)
+{
+    while ((mud->gc.max) && (mud->index.count >= mud->gc.max)) {
+        struct path **next, **lru = NULL;
+        size_t i;
+
+        for (i = 0; i < mud->sessions.size; i++) {
+            struct session *session = mud->sessions.slot[i];
+
+            if (!session)
+                continue;
+
+            for (next = &session->path; *next; next = &(*next)->next) {
+                if ((*next)->state.active)
+                    continue;
+
+                if ((!lru) || ((*next)->recv_time < (*lru)->recv_time))
+                    lru = next;
+            }
+        }
+
+        if (!lru)
+            return -1;
+
+        struct path *path = *lru;
+
+        *lru = path->next;
+        mud_path_remove(mud, path);
+        MUD_STAT(mud->stats.path_evicted);
+    }
+
+    return 0;
+}
+
+static
+void mud_path_seed (struct mud *mud, struct path *path)
+{
+    struct path *from = NULL;
+    struct path *p;
+
+    if (!mud->sessions.cid)
+        return;
+
+    for (p = path->session->path; p; p = p->next) {
+        if ((p == path) || (p->state.active) ||
+            (mud_cmp_ipaddr(&p->local_addr, &path->local_addr)) ||
+            (mud_cmp_host((struct sockaddr *)&p->addr,
+                          (struct sockaddr *)&path->addr)))
+            continue;
+
+        if ((!from) || (p->recv_time > from->recv_time))
+            from = p;
+    }
+
+    if (!from)
+        return;
+
+    path->bak = from->bak;
+    path->rdt = from->rdt;
+    path->rtt = from->rtt;
+    path->sdt = from->sdt;
+    path->rst = from->rst;
+    path->r_sdt = from->r_sdt;
+    path->r_rdt = from->r_rdt;
+    path->r_rst = from->r_rst;
+    path->r_dt = from->r_dt;
+    path->limit = from->limit;
+    path->recv_time = from->recv_time;
+    path->send_time = from->send_time;
+    path->pong_time = from->pong_time;
+
+    from->recv_time = 0;
+
+    MUD_STAT(mud->stats.path_rebound);
+}
+
+static
+struct path *mud_path (struct mud *mud, struct session *session,
+                       struct ipaddr *local_addr, struct sockaddr *addr,
+                       int create)
+{
+    if (local_addr->family != addr->sa_family)
+        return NULL;
+
+    uint64_t hash = mud_path_hash(mud, local_addr, addr);
+    struct path *path = NULL;
+
+    if (mud->index.size) {
+        size_t mask = mud->index.size-1;
+        size_t i = (size_t)hash&mask;
+
+        for (; mud->index.slot[i]; i = (i+1)&mask) {
+            path = mud->index.slot[i];
+
+            if ((path->hash == hash) &&
+                (!mud_cmp_ipaddr(local_addr, &path->local_addr)) &&
+                (!mud_cmp_addr(addr, (struct sockaddr *)&path->addr)))
+                break;
+
+            path = NULL;
+        }
+    }
+
+    if (path || !create)
+        return path;
+
+    if (mud_path_evict(mud) || mud_path_reserve(mud))
+        return NULL;
+
+    path = mud_alloc(sizeof(struct path));
+
+    if (!path)
+        return NULL;
+
+    mud_set_path(path, local_addr, addr);
+
+    path->conn.fd = -1;
+    path->hash = hash;
+    path->session = session;
+
+#if defined MUD_CONNECT
+    if (mud->conn.enabled)
+        mud_path_connect(mud, path);
+#endif
+
+    path->next = session->path;
+    session->path = path;
+
+    mud_path_insert(mud, path);
+    MUD_STAT(mud->stats.path_created);
+
+    return path;
+}
+
+static
+uint64_t mud_session_hash (struct mud *mud, unsigned id)
+{
+    unsigned char buf[MUD_SID_SIZE];
+    unsigned char hash[crypto_shorthash_BYTES];
+
+    mud_write32(buf, id);
+    crypto_shorthash(hash, buf, sizeof(buf), mud->index.key);
+
+    uint64_t ret;
+    memcpy(&ret, hash, sizeof(ret));
+
+    return ret;
+}
+
+static
+struct session *mud_session (struct mud *mud, unsigned id)
+{
+    if (!mud->sessions.size)
+        return NULL;
+
+    size_t mask = mud->sessions.size-1;
+    size_t i = (size_t)mud_session_hash(mud, id)&mask;
+
+    for (; mud->sessions.slot[i]; i = (i+1)&mask) {
+        if (mud->sessions.slot[i]->id == id)
+            return mud->sessions.slot[i];
+    }
+
+    return NULL;
+}
+
+static
+void mud_session_insert (struct mud *mud, struct session *session)
+{
+    size_t mask = mud->sessions.size-1;
+    size_t i = (size_t)session->hash&mask;
+
+    while (mud->sessions.slot[i])
+        i = (i+1)&mask;
+
+    mud->sessions.slot[i] = session;
+    mud->sessions.count++;
+}
+
+static
+int mud_session_reserve (struct mud *mud)
+{
+    if (2*(mud->sessions.count+1) <= mud->sessions.size)
+        return 0;
+
+    size_t size = mud->sessions.size ? 2*mud->sessions.size : 4;
+    struct session **slot = calloc(size, sizeof(struct session *));
+
+    if (!slot)
+        return -1;
+
+    struct session **old = mud->sessions.slot;
+    size_t i, old_size = mud->sessions.size;
+
+    mud->sessions.slot = slot;
+    mud->sessions.size = size;
+    mud->sessions.count = 0;
+
+    for (i = 0; i < old_size; i++) {
+        if (old[i])
+            mud_session_insert(mud, old[i]);
+    }
+
+    free(old);
+
+    return 0;
+}
+
+static
+void mud_session_remove (struct mud *mud, struct session *session)
+{
+    size_t mask = mud->sessions.size-1;
+    size_t i = (size_t)session->hash&mask;
+    size_t j;
+
+    while (mud->sessions.slot[i] != session)
+        i = (i+1)&mask;
+
+    for (j = (i+1)&mask; mud->sessions.slot[j]; j = (j+1)&mask) {
+        size_t k = (size_t)mud->sessions.slot[j]->hash&mask;
+
+        if ((j > i) ? ((k <= i) || (k > j)) : ((k <= i) && (k > j))) {
+            mud->sessions.slot[i] = mud->sessions.slot[j];
+            i = j;
+        }
+    }
+
+    mud->sessions.slot[i] = NULL;
+    mud->sessions.count--;
+}
+
+static
+void mud_session_free (struct mud *mud, struct session *session)
+{
+    while (session->path) {
+        struct path *path = session->path;
+        session->path = path->next;
+        mud_path_remove(mud, path);
+    }
+
+    free(session);
+}
+
+static
+int mud_ipaddrinfo (struct ipaddr *ipaddr, const char *name)
+{
+    if (!name) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (inet_pton(AF_INET, name, &ipaddr->ip.v4) == 1) {
+        ipaddr->family = AF_INET;
+        return 0;
+    }
+
+    if (inet_pton(AF_INET6, name, &ipaddr->ip.v6) == 1) {
+        ipaddr->family = AF_INET6;
+        return 0;
+    }
+
+    return -1;
+}
+
+int mud_peer (struct mud *mud, const char *name, const char *host, int port, int backup)
+{
+    if (!name || !host || !port) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct ipaddr local_addr;
+
+    if (mud_ipaddrinfo(&local_addr, name))
+        return -1;
+
+    struct sockaddr_storage addr;
+
+    if (mud_addrinfo(&addr, host, port))
+        return -1;
+
+    mud_unmapv4((struct sockaddr *)&addr);
+
+    mud_lock(mud, 1);
+
+    struct path *path = mud_path(mud, mud->session, &local_addr,
+                                 (struct sockaddr *)&addr, 1);
+
+    if (!path) {
+        mud_unlock(mud);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    path->state.active = 1;
+    path->bak.local = !!backup;
+
+    MUD_STORE(mud->timer.deadline, 0);
+
+    mud_unlock(mud);
+
+    return 0;
+}
+
+int mud_get_key (struct mud *mud, unsigned char *key, size_t *size)
+{
+    if (!key || !size || (*size < MUD_KEY_SIZE)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memcpy(key, mud->session->crypto.private.encrypt.key, MUD_KEY_SIZE);
+    *size = MUD_KEY_SIZE;
+
+    return 0;
+}
+
+static
+void mud_session_key (struct session *session, const unsigned char *key)
+{
+    memcpy(session->crypto.private.encrypt.key, key, MUD_KEY_SIZE);
+    memcpy(session->crypto.private.decrypt.key, key, MUD_KEY_SIZE);
+
+    session->crypto.current = session->crypto.private;
+    session->crypto.next = session->crypto.private;
+    session->crypto.last = session->crypto.private;
+}
+
+int mud_set_key (struct mud *mud, unsigned char *key, size_t size)
+{
+    if (!key || (size < MUD_KEY_SIZE)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mud_lock(mud, 1);
+    mud_session_key(mud->session, key);
+    mud_unlock(mud);
+
+    return 0;
+}
+
+int mud_set_send_timeout_msec (struct mud *mud, unsigned msec)
+{
+    if (!msec) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mud->send_timeout = msec*MUD_ONE_MSEC;
+    MUD_STORE(mud->timer.deadline, 0);
+
+    return 0;
+}
+
+int mud_set_time_tolerance_sec (struct mud *mud, unsigned sec)
+{
+    if (!sec) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mud->time_tolerance = sec*MUD_ONE_SEC;
+
+    return 0;
+}
+
+int mud_set_filter_rate (struct mud *mud, unsigned rate)
+{
+    mud_lock(mud, 1);
+
+    mud->filter.rate = rate;
+    mud->filter.tokens = (uint64_t)rate*MUD_ONE_SEC;
+    mud->filter.time = 0;
+
+    mud_unlock(mud);
+
+    return 0;
+}
+
+int mud_set_path_max (struct mud *mud, unsigned max)
+{
+    mud_lock(mud, 1);
+
+    mud->gc.max = max;
+
+    mud_unlock(mud);
+
+    return 0;
+}
+
+int mud_set_path_idle_sec (struct mud *mud, unsigned sec)
+{
+    mud_lock(mud, 1);
+
+    mud->gc.idle = sec*MUD_ONE_SEC;
+    MUD_STORE(mud->timer.deadline, 0);
+
+    mud_unlock(mud);
+
+    return 0;
+}
+
+int mud_get_stats (struct mud *mud, struct mud_stats *stats)
+{
+    if (!stats) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memcpy(stats, &mud->stats, sizeof(struct mud_stats));
+
+    return 0;
+}
+
+static
+int mud_mtu (struct mud *mud, struct session *session)
+{
+    if ((!session->mtu.remote) ||
+        (mud->mtu.local < session->mtu.remote))
+        return mud->mtu.local;
+
+    return session->mtu.remote;
+}
+
+int mud_get_mtu (struct mud *mud)
+{
+    return mud_mtu(mud, mud->session);
+}
+
+int mud_set_mtu (struct mud *mud, int mtu)
+{
+    if ((mtu < 500) ||
+        (mtu > MUD_PACKET_MAX_SIZE-50)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (mud->mtu.local != mtu) {
+        size_t i;
+
+        mud->mtu.local = mtu;
+
+        for (i = 0; i < mud->sessions.size; i++) {
+            if (mud->sessions.slot[i])
+                mud->sessions.slot[i]->mtu.send_time = UINT64_C(0);
+        }
+
+        MUD_STORE(mud->timer.deadline, 0);
+    }
+
+    return 0;
+}
+
+int mud_set_gso (struct mud *mud, int enable)
+{
+#if defined MUD_GSO
+    if (enable && ((mud->uring.enabled) || (mud->io.enabled))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (enable && mud_sso_int(mud->fd, IPPROTO_UDP, UDP_SEGMENT, 0))
+        return -1;
+
+    mud->gso = !!enable;
+
+    return 0;
+#else
+    if (!enable)
+        return 0;
+
+    errno = ENOTSUP;
+
+    return -1;
+#endif
+}
+
+#if defined MUD_GRO
+static
+int mud_set_gro_rx (int fd, struct rx *rx, int enable)
+{
+    size_t size = enable ? MUD_GRO_SIZE : MUD_PACKET_MAX_SIZE;
+    unsigned max = enable ? MUD_GRO_BATCH : MUD_BATCH_SIZE;
+    unsigned char *data = malloc(size*max);
+
+    if (!data)
+        return -1;
+
+    if (mud_sso_int(fd, IPPROTO_UDP, UDP_GRO, !!enable)) {
+        int err = errno;
+        free(data);
+        errno = err;
+        return -1;
+    }
+
+    free(rx->data);
+
+    rx->data = data;
+    rx->size = size;
+    rx->max = max;
+
+    return 0;
+}
+#endif
+
+int mud_set_gro (struct mud *mud, int enable)
+{
+#if defined MUD_GRO
+    if ((mud->rx.index < mud->rx.count) || (mud->uring.enabled)) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    unsigned i;
+
+    for (i = 1; i < mud->shard.count; i++) {
+        struct rx *rx = &mud->shard.data[i-1].rx;
+
+        if (rx->index < rx->count) {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+
+    if (mud_set_gro_rx(mud->fd, &mud->rx, enable))
+        return -1;
+
+    for (i = 1; i < mud->shard.count; i++) {
+        struct shard *shard = &mud->shard.data[i-1];
+
+        if (mud_set_gro_rx(shard->fd, &shard->rx, enable))
+            return -1;
+    }
+
+    size_t j;
+
+    for (j = 0; j < mud->sessions.size; j++) {
+        struct path *path;
+
+        if (!mud->sessions.slot[j])
+            continue;
+
+        for (path = mud->sessions.slot[j]->path; path; path = path->next) {
+            if (path->conn.fd != -1)
+                mud_sso_int(path->conn.fd, IPPROTO_UDP, UDP_GRO, !!enable);
+        }
+    }
+
+    return 0;
+#else
+    if (!enable)
+        return 0;
+
+    errno = ENOTSUP;
+
+    return -1;
+#endif
+}
+
+#if defined MUD_IO_URING
+static
+void mud_uring_exit (struct mud *mud)
+{
+    if (mud->uring.br)
+        io_uring_free_buf_ring(&mud->uring.ring, mud->uring.br,
+                               mud->uring.count, 0);
+
+    if (mud->uring.enabled)
+        io_uring_queue_exit(&mud->uring.ring);
+
+    free(mud->uring.data);
+    free(mud->uring.slot);
+    free(mud->uring.free);
+    free(mud->uring.lease);
+
+    memset(&mud->uring, 0, sizeof(mud->uring));
+}
+#endif
+
+int mud_set_io_queue (struct mud *mud, int enable)
+{
+    if (enable && ((mud->gso) || (mud->uring.enabled) || (mud->conn.enabled))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!enable) {
+        if (!mud->io.enabled)
+            return 0;
+
+        mud->io.enabled = 0;
+        pthread_mutex_destroy(&mud->io.mutex);
+        free(mud->io.slot);
+
+        mud->io.slot = NULL;
+        mud->io.head = 0;
+        mud->io.count = 0;
+        mud->io.lease = 0;
+
+        return 0;
+    }
+
+    if (mud->io.enabled)
+        return 0;
+
+    mud->io.slot = malloc(MUD_IO_SIZE*sizeof(struct io_slot));
+
+    if (!mud->io.slot)
+        return -1;
+
+    pthread_mutex_init(&mud->io.mutex, NULL);
+    mud->io.enabled = 1;
+
+    return 0;
+}
+
+int mud_set_clock (struct mud *mud, uint64_t now)
+{
+    MUD_STORE(mud->io.clock, now);
+
+    return 0;
+}
+
+int mud_set_io_uring (struct mud *mud, int enable)
+{
+#if defined MUD_IO_URING
+    if (enable && ((mud->shard.count > 1) || (mud->conn.enabled) ||
+                   (mud->io.enabled))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (mud->rx.index < mud->rx.count) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if (!enable) {
+        mud_uring_exit(mud);
+        return 0;
+    }
+
+    if (mud->uring.enabled)
+        return 0;
+
+    mud->uring.size = sizeof(struct io_uring_recvmsg_out)
+                    + sizeof(struct sockaddr_storage)
+                    + sizeof(mud->rx.ctrl[0])
+                    + mud->rx.size;
+    mud->uring.count = 8*mud->rx.max;
+
+    mud->uring.data = malloc(mud->uring.size*mud->uring.count);
+    mud->uring.slot = malloc(MUD_URING_SIZE*sizeof(struct uring_slot));
+    mud->uring.free = malloc(MUD_URING_SIZE*sizeof(unsigned));
+    mud->uring.lease = malloc(mud->uring.count*sizeof(unsigned));
+
+    if (!mud->uring.data || !mud->uring.slot ||
+        !mud->uring.free || !mud->uring.lease) {
+        mud_uring_exit(mud);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int ret = io_uring_queue_init(MUD_URING_SIZE, &mud->uring.ring, 0);
+
+    if (ret < 0) {
+        mud_uring_exit(mud);
+        errno = -ret;
+        return -1;
+    }
+
+    mud->uring.enabled = 1;
+    mud->uring.br = io_uring_setup_buf_ring(&mud->uring.ring,
+                                            mud->uring.count, 0, 0, &ret);
+
+    if (!mud->uring.br) {
+        mud_uring_exit(mud);
+        errno = -ret;
+        return -1;
+    }
+
+    unsigned i;
+
+    for (i = 0; i < mud->uring.count; i++)
+        mud_uring_recycle(mud, i);
+
+    for (i = 0; i < MUD_URING_SIZE; i++)
+        mud->uring.free[i] = i;
+
+    mud->uring.free_count = MUD_URING_SIZE;
+
+    mud->uring.msg = (struct msghdr) {
+        .msg_namelen = sizeof(struct sockaddr_storage),
+        .msg_controllen = sizeof(mud->rx.ctrl[0]),
+    };
+
+    mud->gso = 0;
+
+    mud_uring_arm(mud);
+    io_uring_submit(&mud->uring.ring);
+
+    return 0;
+#else
+    (void)mud;
+
+    if (!enable)
+        return 0;
+
+    errno = ENOTSUP;
+
+    return -1;
+#endif
+}
+
+int mud_set_connect (struct mud *mud, int enable)
+{
+#if defined MUD_CONNECT
+    struct path *path;
+    size_t i;
+
+    if (!enable) {
+        if (!mud->conn.enabled)
+            return 0;
+
+        for (i = 0; i < mud->sessions.size; i++) {
+            if (!mud->sessions.slot[i])
+                continue;
+
+            for (path = mud->sessions.slot[i]->path; path; path = path->next)
+                mud_path_close(path);
+        }
+
+        int err = errno;
+        close(mud->conn.epoll);
+        errno = err;
+
+        mud->conn.enabled = 0;
+
+        return 0;
+    }
+
+    if (mud->conn.enabled)
+        return 0;
+
+    if ((mud->uring.enabled) || (mud->io.enabled) || (mud->shard.count > 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (mud->rx.index < mud->rx.count) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    mud->conn.epoll = epoll_create1(EPOLL_CLOEXEC);
+
+    if (mud->conn.epoll == -1)
+        return -1;
+
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.fd = mud->fd,
+    };
+
+    if (epoll_ctl(mud->conn.epoll, EPOLL_CTL_ADD, mud->fd, &ev)) {
+        int err = errno;
+        close(mud->conn.epoll);
+        errno = err;
+        return -1;
+    }
+
+    mud->conn.enabled = 1;
+
+    for (i = 0; i < mud->sessions.size; i++) {
+        if (!mud->sessions.slot[i])
+            continue;
+
+        for (path = mud->sessions.slot[i]->path; path; path = path->next)
+            mud_path_connect(mud, path);
+    }
+
+    return 0;
+#else
+    if (!enable)
+        return 0;
+
+    errno = ENOTSUP;
+
+    return -1;
+#endif
+}
+
+static
+int mud_create_socket (int port, int v4, int v6, int shard)
+{
+    struct sockaddr_storage addr;
+
+    if (mud_addrinfo(&addr, v6 ? "::" : "0.0.0.0", port))
+        return -1;
+
+    int fd = socket(addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+
+    if (fd == -1)
+        return -1;
+
+    if (mud_setup_socket(fd, v4, v6, shard) ||
+        bind(fd, (struct sockaddr *)&addr, mud_addrlen(&addr))) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    return fd;
+}
+
+static
+void mud_shard_steer (int fd, unsigned count)
+{
+#if defined MUD_SHARD && defined SO_ATTACH_REUSEPORT_CBPF
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF+SKF_AD_RXHASH),
+        BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, 2, 0),
+        BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, count),
+        BPF_STMT(BPF_RET|BPF_A, 0),
+        BPF_STMT(BPF_RET|BPF_K, UINT32_MAX),
+    };
+
+    struct sock_fprog prog = {
+        .len = sizeof(code)/sizeof(code[0]),
+        .filter = code,
+    };
+
+    setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+#endif
+}
+
+static
+int mud_shard_init (struct mud *mud, int v4, int v6, unsigned count)
+{
+    mud->shard.data = mud_alloc((count-1)*sizeof(struct shard));
+
+    if (!mud->shard.data)
+        return -1;
+
+    unsigned i;
+
+    for (i = 0; i < count-1; i++)
+        mud->shard.data[i].fd = -1;
+
+    int ret = pthread_rwlock_init(&mud->shard.lock, NULL);
+
+    if (ret) {
+        errno = ret;
+        return -1;
+    }
+
+    mud->shard.count = count;
+
+    for (i = 0; i < count-1; i++) {
+        struct shard *shard = &mud->shard.data[i];
+
+        shard->rx.size = MUD_PACKET_MAX_SIZE;
+        shard->rx.max = MUD_BATCH_SIZE;
+        shard->rx.data = malloc(shard->rx.size*shard->rx.max);
+
+        if (!shard->rx.data)
+            return -1;
+
+        shard->fd = mud_create_socket(mud->port, v4, v6, 1);
+
+        if (shard->fd == -1)
+            return -1;
+    }
+
+    mud_shard_steer(mud->fd, count);
+
+    return 0;
+}
+
+static
+unsigned char mud_keyx_flags (struct mud *mud)
+{
+    if (!mud->crypto.ctr && !mud->crypto.epoch && !mud->crypto.aegis)
+        return (unsigned char)mud->crypto.aes;
+
+    return (unsigned char)(MUD_PKEY_EXT |
+                           (mud->crypto.aes ? MUD_PKEY_AES : 0) |
+                           (mud->crypto.aegis ? MUD_PKEY_AEGIS128L : 0) |
+                           (mud->crypto.aegis ? MUD_PKEY_AEGIS256 : 0) |
+                           (mud->crypto.ctr ? MUD_PKEY_CTR : 0) |
+                           (mud->crypto.epoch ? MUD_PKEY_EPOCH : 0));
+}
+
+static
+void mud_keyx_spare (struct session *session)
+{
+    if (session->crypto.spare.ready)
+        return;
+
+    randombytes_buf(session->crypto.spare.secret,
+                    sizeof(session->crypto.spare.secret));
+    crypto_scalarmult_base(session->crypto.spare.public,
+                           session->crypto.spare.secret);
+    session->crypto.spare.ready = 1;
+}
+
+static
+void mud_keyx_init (struct mud *mud, struct session *session)
+{
+    mud_keyx_spare(session);
+
+    memcpy(session->crypto.secret, session->crypto.spare.secret,
+           sizeof(session->crypto.secret));
+
+    memcpy(session->crypto.public.send, session->crypto.spare.public,
+           sizeof(session->crypto.spare.public));
+
+    session->crypto.spare.ready = 0;
+    MUD_STORE(mud->sessions.pending, 1);
+    MUD_STORE(mud->timer.deadline, 0);
+
+    memset(session->crypto.public.recv, 0, sizeof(session->crypto.public.recv));
+    session->crypto.public.send[MUD_PKEY_SIZE-1] = mud_keyx_flags(mud);
+}
+
+static
+void mud_keyx_update (struct mud *mud)
+{
+    size_t i;
+
+    for (i = 0; i < mud->sessions.size; i++) {
+        struct session *session = mud->sessions.slot[i];
+
+        if (session)
+            session->crypto.public.send[MUD_PKEY_SIZE-1] = mud_keyx_flags(mud);
+    }
+}
+
+int mud_set_nonce_counter (struct mud *mud, int enable)
+{
+    mud_lock(mud, 1);
+
+    mud->crypto.ctr = !!enable;
+    mud_keyx_update(mud);
+
+    mud_unlock(mud);
+
+    return 0;
+}
+
+int mud_set_key_epoch (struct mud *mud, int enable)
+{
+    mud_lock(mud, 1);
+
+    mud->crypto.epoch = !!enable;
+    mud_keyx_update(mud);
+
+    mud_unlock(mud);
+
+    return 0;
+}
+
+int mud_set_aegis (struct mud *mud, int enable)
+{
+#if defined MUD_AEGIS
+    if (enable && !sodium_runtime_has_aesni()) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    mud_lock(mud, 1);
+
+    mud->crypto.aegis = !!enable;
+    mud_keyx_update(mud);
+
+    mud_unlock(mud);
+
+    return 0;
+#else
+    if (!enable)
+        return 0;
+
+    errno = ENOTSUP;
+
+    return -1;
+#endif
+}
+
+static
+struct session *mud_session_new (struct mud *mud, unsigned id)
+{
+    if (mud_session_reserve(mud))
+        return NULL;
+
+    struct session *session = mud_alloc(sizeof(struct session));
+
+    if (!session)
+        return NULL;
+
+    session->id = id;
+    session->hash = mud_session_hash(mud, id);
+    session->crypto.private.suite = mud_suite(0);
+
+    mud_keyx_init(mud, session);
+    mud_session_insert(mud, session);
+
+    return session;
+}
+
+int mud_set_session (struct mud *mud, unsigned id)
+{
+    mud_lock(mud, 1);
+
+    if (mud->session->id != id) {
+        if (mud_session(mud, id)) {
+            mud_unlock(mud);
+            errno = EEXIST;
+            return -1;
+        }
+
+        mud_session_remove(mud, mud->session);
+        mud->session->id = id;
+        mud->session->hash = mud_session_hash(mud, id);
+        mud_session_insert(mud, mud->session);
+    }
+
+    mud->sessions.enabled = 1;
+
+    mud_unlock(mud);
+
+    return 0;
+}
+
+int mud_add_session (struct mud *mud, unsigned id,
+                     unsigned char *key, size_t size)
+{
+    if (!key || (size < MUD_KEY_SIZE)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mud_lock(mud, 1);
+
+    if (mud_session(mud, id)) {
+        mud_unlock(mud);
+        errno = EEXIST;
+        return -1;
+    }
+
+    struct session *session = mud_session_new(mud, id);
+
+    if (!session) {
+        mud_unlock(mud);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    mud_session_key(session, key);
+    mud->sessions.enabled = 1;
+
+    mud_unlock(mud);
+
+    return 0;
+}
+
+int mud_del_session (struct mud *mud, unsigned id)
+{
+    mud_lock(mud, 1);
+
+    struct session *session = mud_session(mud, id);
+
+    if (!session || (session == mud->session)) {
+        mud_unlock(mud);
+        errno = session ? EINVAL : ENOENT;
+        return -1;
+    }
+
+    mud_session_remove(mud, session);
+    mud_session_free(mud, session);
+
+    mud_unlock(mud);
+
+    return 0;
+}
+
+int mud_set_conn_id (struct mud *mud, int enable)
+{
+    mud_lock(mud, 1);
+
+    mud->sessions.cid = !!enable;
+
+    if (enable)
+        mud->sessions.enabled = 1;
+
+    mud_unlock(mud);
+
+    return 0;
+}
+
+int mud_set_crypto_workers (struct mud *mud, unsigned count)
+{
+#if defined MUD_POOL
+    if (count > MUD_POOL_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mud_pool_stop(mud);
+
+    if (!count)
+        return 0;
+
+    mud->pool.worker = mud_alloc(count*sizeof(struct pool_worker));
+
+    if (!mud->pool.worker)
+        return -1;
+
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        struct pool_worker *w = &mud->pool.worker[i];
+
+        w->mud = mud;
+        pthread_mutex_init(&w->mutex, NULL);
+        pthread_cond_init(&w->cond, NULL);
+
+        int err = pthread_create(&w->thread, NULL, mud_pool_main, w);
+
+        if (err) {
+            pthread_cond_destroy(&w->cond);
+            pthread_mutex_destroy(&w->mutex);
+            mud_pool_stop(mud);
+            errno = err;
+            return -1;
+        }
+
+        mud->pool.count = i+1;
+    }
+
+    return 0;
+#else
+    if (!count)
+        return 0;
+
+    errno = ENOTSUP;
+
+    return -1;
+#endif
+}
+
+struct mud *mud_create_shards (int port, int v4, int v6, int aes, int mtu,
+                               unsigned shards)
+{
+    if (!shards) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+#if !defined MUD_SHARD
+    if (shards > 1) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+#endif
+
+    if (sodium_init() == -1)
+        return NULL;
+
+    struct mud *mud = mud_alloc(sizeof(struct mud));
+
+    if (!mud)
+        return NULL;
+
+    mud->shard.count = 1;
+    mud->fd = mud_create_socket(port, v4, v6, shards > 1);
+
+    if (mud->fd == -1) {
+        mud_delete(mud);
+        return NULL;
+    }
+
+    mud->rx.size = MUD_PACKET_MAX_SIZE;
+    mud->rx.max = MUD_BATCH_SIZE;
+    mud->rx.data = malloc(mud->rx.size*mud->rx.max);
+
+    if (!mud->rx.data) {
+        mud_delete(mud);
+        return NULL;
+    }
+
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+
+    if (getsockname(mud->fd, (struct sockaddr *)&addr, &addrlen)) {
+        mud_delete(mud);
+        return NULL;
+    }
+
+    mud->port = ntohs((addr.ss_family == AF_INET)
+                      ? ((struct sockaddr_in *)&addr)->sin_port
+                      : ((struct sockaddr_in6 *)&addr)->sin6_port);
+
+    if ((shards > 1) && mud_shard_init(mud, v4, v6, shards)) {
+        mud_delete(mud);
+        return NULL;
+    }
+
+    mud->send_timeout = MUD_SEND_TIMEOUT;
+    mud->time_tolerance = MUD_TIME_TOLERANCE;
+    mud->mtu.local = mtu;
+    mud->crypto.aes = aes && crypto_aead_aes256gcm_is_available();
+
+    randombytes_buf(mud->index.key, sizeof(mud->index.key));
+
+    mud->session = mud_session_new(mud, 0);
+
+    if (!mud->session) {
+        mud_delete(mud);
+        return NULL;
+    }
+
+    unsigned char key[MUD_KEY_SIZE];
+
+    randombytes_buf(key, sizeof(key));
+    mud_session_key(mud->session, key);
+
+    return mud;
+}
+
+struct mud *mud_create (int port, int v4, int v6, int aes, int mtu)
+{
+    return mud_create_shards(port, v4, v6, aes, mtu, 1);
+}
+
+int mud_get_fd (struct mud *mud)
+{
+#if defined MUD_IO_URING
+    if (mud->uring.enabled)
+        return mud->uring.ring.ring_fd;
+#endif
+#if defined MUD_CONNECT
+    if (mud->conn.enabled)
+        return mud->conn.epoll;
+#endif
+    return mud->fd;
+}
+
+int mud_get_shard_fd (struct mud *mud, unsigned shard)
+{
+    if (!shard)
+        return mud_get_fd(mud);
+
+    if (shard >= mud->shard.count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return mud->shard.data[shard-1].fd;
+}
+
+void mud_delete (struct mud *mud)
+{
+    if (!mud)
+        return;
+
+#if defined MUD_CONNECT
+    mud_set_connect(mud, 0);
+#endif
+
+#if defined MUD_POOL
+    mud_pool_stop(mud);
+#endif
+
+    mud_set_io_queue(mud, 0);
+
+    size_t i;
+
+    for (i = 0; i < mud->sessions.size; i++) {
+        if (mud->sessions.slot[i])
+            mud_session_free(mud, mud->sessions.slot[i]);
+    }
+
+    free(mud->sessions.slot);
+    free(mud->index.slot);
+
+    if (mud->fd != -1) {
+        int err = errno;
+        close(mud->fd);
+        errno = err;
+    }
+
+#if defined MUD_IO_URING
+    mud_uring_exit(mud);
+#endif
+
+    if (mud->shard.count > 1) {
+        unsigned i;
+
+        for (i = 0; i < mud->shard.count-1; i++) {
+            struct shard *shard = &mud->shard.data[i];
+
+            if (shard->fd != -1) {
+                int err = errno;
+                close(shard->fd);
+                errno = err;
+            }
+
+            free(shard->rx.data);
+            free(shard->tx.sched.data);
+        }
+
+        pthread_rwlock_destroy(&mud->shard.lock);
+    }
+
+    free(mud->shard.data);
+    free(mud->tx.sched.data);
+    free(mud->rx.data);
+    free(mud);
+}
+
+static
+uint64_t mud_nonce (struct mud *mud, struct session *session,
+                    struct crypto_key *key, uint64_t now, unsigned count)
+{
+    if (!now)
+        return 0;
+
+    if (key->ctr) {
+        uint64_t max = key->epoch ? UINT64_C(1)<<40 : UINT64_C(1)<<48;
+        uint64_t nonce = MUD_ADD(key->nonce, count)+1;
+
+        if (nonce+count > max) {
+            errno = EAGAIN;
+            return 0;
+        }
+
+        return nonce;
+    }
+
+    uint64_t last = MUD_LOAD(session->crypto.nonce);
+    uint64_t nonce;
+
+    do {
+        nonce = (now > last) ? now : last+1;
+
+        if (nonce+count-1-now >= mud->time_tolerance) {
+            errno = EAGAIN;
+            return 0;
+        }
+    } while (!MUD_CAS(session->crypto.nonce, last, nonce+count-1));
+
+    return nonce;
+}
+
+static
+size_t mud_key_header (const struct crypto_key *key)
+{
+    if (key->ctr)
+        return MUD_HEADER_MAX_SIZE;
+
+    return key->epoch ? MUD_U48_SIZE+1 : MUD_U48_SIZE;
+}
+
+static
+struct crypto_key *mud_encrypt_key (struct session *session)
+{
+    return session->crypto.use_next ? &session->crypto.next
+                                    : &session->crypto.current;
+}
+
+static
+size_t mud_cid_size (struct mud *mud)
+{
+    return mud->sessions.cid ? MUD_SID_SIZE : 0;
+}
+
+static
+size_t mud_header_size (struct mud *mud, struct session *session)
+{
+    return mud_cid_size(mud)+mud_key_header(mud_encrypt_key(session));
+}
+
+static
+int mud_encrypt_header (struct mud *mud, struct session *session,
+                        struct crypto_key *key, uint64_t now, uint64_t nonce,
+                        unsigned char *dst, size_t dst_size,
+                        const unsigned char *src, size_t src_size,
+                        struct crypto_opt *opt)
+{
+    size_t cid_size = mud_cid_size(mud);
+    size_t hdr_size = cid_size+mud_key_header(key);
+    size_t size = src_size+hdr_size+MUD_MAC_SIZE;
+
+    if (size > dst_size)
+        return 0;
+
+    unsigned char *hdr = dst+cid_size;
+
+    memset(opt, 0, sizeof(struct crypto_opt));
+
+    opt->dst = dst+hdr_size;
+    opt->src.data = src;
+    opt->src.size = src_size;
+    opt->ad.data = dst;
+    opt->ad.size = hdr_size;
+
+    if (key->ctr) {
+        mud_write48(hdr, now);
+
+        if (key->epoch) {
+            mud_write48(&hdr[MUD_U48_SIZE], (nonce<<8)|key->encrypt.tag);
+        } else {
+            mud_write48(&hdr[MUD_U48_SIZE], nonce);
+        }
+
+        mud_write48(opt->npub, nonce);
+        opt->npub[MUD_U48_SIZE] = 1;
+    } else {
+        mud_write48(opt->npub, nonce);
+        memcpy(hdr, opt->npub, MUD_U48_SIZE);
+
+        if (key->epoch)
+            hdr[MUD_U48_SIZE] = key->encrypt.tag;
+    }
+
+    if (cid_size)
+        mud_write32(dst, session->id);
+
+    return (int)size;
+}
+
+struct crypto_batch {
+    struct mud *mud;
+    const struct crypto_key *key;
+    const struct crypto_opt *opt;
+    struct crypto_job *job;
+};
+
+static
+void mud_encrypt_task (void *arg, unsigned i)
+{
+    struct crypto_batch *batch = (struct crypto_batch *)arg;
+
+    batch->key->suite->encrypt(batch->key, &batch->opt[i]);
+}
+
+static
+void mud_encrypt_opts (struct mud *mud, const struct crypto_key *key,
+                       const struct crypto_opt *opt, unsigned count)
+{
+    struct crypto_batch batch = {
+        .key = key,
+        .opt = opt,
+    };
+
+    mud_pool_run(mud, mud_encrypt_task, &batch, count);
+}
+
+static
+int mud_encrypt (struct mud *mud, struct session *session, uint64_t now,
+                 unsigned char *dst, size_t dst_size,
+                 const unsigned char *src, size_t src_size)
+{
+    struct crypto_key *key = mud_encrypt_key(session);
+    struct crypto_opt opt;
+    uint64_t nonce = mud_nonce(mud, session, key, now, 1);
+
+    if (!nonce)
+        return 0;
+
+    int size = mud_encrypt_header(mud, session, key, now, nonce,
+                                  dst, dst_size, src, src_size, &opt);
+
+    if (!size) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    mud_encrypt_opt(key, &opt);
+
+    return size;
+}
+
+static
+void mud_key_sync (struct crypto_key *key, const struct crypto_key *from)
+{
+    if ((!memcmp(key->encrypt.key, from->encrypt.key, MUD_KEY_SIZE)) &&
+        (key->ctr == from->ctr) && (key->epoch == from->epoch) &&
+        (key->nonce < from->nonce))
+        key->nonce = from->nonce;
+}
+
+static
+void mud_keyx_rotate (struct mud *mud, struct session *session)
+{
+    if (!memcmp(session->crypto.current.decrypt.key,
+                session->crypto.next.decrypt.key, MUD_KEY_SIZE))
+        return;
+
+    mud_keyx_init(mud, session);
+    session->crypto.last = session->crypto.current;
+    session->crypto.current = session->crypto.next;
+    session->crypto.use_next = 0;
+
+    mud_key_sync(&session->crypto.current, &session->crypto.last);
+}
+
+static
+int mud_decrypt_key (const struct crypto_key *key, size_t cid_size,
+                     unsigned char *dst, size_t dst_size,
+                     unsigned char *packet, const unsigned char *src,
+                     size_t src_size)
+{
+    size_t hdr_size = cid_size+mud_key_header(key);
+
+    if (src_size < hdr_size+MUD_MAC_SIZE)
+        return -1;
+
+    size_t size = src_size-hdr_size-MUD_MAC_SIZE;
+
+    if (!dst) {
+        dst = packet+hdr_size;
+    } else if (size > dst_size) {
+        return -1;
+    }
+
+    struct crypto_opt opt = {
+        .dst = dst,
+        .src = { .data = src+hdr_size,
+                 .size = src_size-hdr_size },
+        .ad  = { .data = src,
+                 .size = hdr_size },
+    };
+
+    const unsigned char *hdr = src+cid_size;
+
+    if (key->ctr) {
+        uint64_t nonce = mud_read48(&hdr[MUD_U48_SIZE]);
+
+        if (key->epoch)
+            nonce >>= 8;
+
+        mud_write48(opt.npub, nonce);
+        opt.npub[MUD_U48_SIZE] = 1;
+    } else {
+        memcpy(opt.npub, hdr, MUD_U48_SIZE);
+    }
+
+    if (mud_decrypt_opt(key, &opt))
+        return -1;
+
+    return (int)size;
+}
+
+static
+int mud_decrypt (struct mud *mud, struct session *session,
+                 unsigned char *dst, size_t dst_size,
+                 unsigned char *src, size_t src_size, int *rotate)
+{
+    size_t cid_size = mud_cid_size(mud);
+
+    const struct crypto_key *keys[] = {
+        &session->crypto.current,
+        &session->crypto.next,
+        &session->crypto.last,
+        &session->crypto.private,
+    };
+
+    const struct crypto_key *list[4];
+    unsigned count = session->crypto.current.epoch ? 3 : 4;
+    unsigned i, j, n = 0;
+    int big = 0;
+
+    for (i = 0; i < count; i++) {
+        const struct crypto_key *key = keys[i];
+
+        if ((dst) &&
+            (src_size > cid_size+mud_key_header(key)+MUD_MAC_SIZE+dst_size)) {
+            big = 1;
+            continue;
+        }
+
+        if ((key->epoch) &&
+            ((src_size <= cid_size+MUD_U48_SIZE) ||
+             (src[cid_size+MUD_U48_SIZE] != key->decrypt.tag)))
+            continue;
+
+        for (j = 0; j < n; j++) {
+            if ((list[j]->suite == key->suite) &&
+                (list[j]->ctr == key->ctr) && (list[j]->epoch == key->epoch) &&
+                (!memcmp(list[j]->decrypt.key, key->decrypt.key, MUD_KEY_SIZE)))
+                break;
+        }
+
+        if (j < n)
+            continue;
+
+        list[n++] = key;
+    }
+
+    unsigned char tmp[MUD_PACKET_MAX_SIZE];
+    const unsigned char *data = src;
+
+    if ((!dst) && (n > 1)) {
+        if (src_size > sizeof(tmp))
+            return 0;
+
+        memcpy(tmp, src, src_size);
+        data = tmp;
+    }
+
+    for (i = 0; i < n; i++) {
+        MUD_STAT(mud->stats.aead);
+
+        int ret = mud_decrypt_key(list[i], cid_size, dst, dst_size,
+                                  src, data, src_size);
+
+        if (ret == -1)
+            continue;
+
+        if (list[i] == &session->crypto.next)
+            *rotate = 1;
+
+        return ret;
+    }
+
+    return big ? 0 : -1;
+}
+
+static
+int mud_localaddr (struct ipaddr *local_addr, struct msghdr *msg, int family)
+{
+    int cmsg_level = IPPROTO_IP;
+    int cmsg_type = MUD_PKTINFO;
+
+    if (family == AF_INET6) {
+        cmsg_level = IPPROTO_IPV6;
+        cmsg_type = IPV6_PKTINFO;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+
+    for (; cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if ((cmsg->cmsg_level == cmsg_level) &&
+            (cmsg->cmsg_type == cmsg_type))
+            break;
+    }
+
+    if (!cmsg)
+        return 1;
+
+    local_addr->family = family;
+
+    if (family == AF_INET) {
+        memcpy(&local_addr->ip.v4,
+               MUD_PKTINFO_SRC(CMSG_DATA(cmsg)),
+               sizeof(struct in_addr));
+    } else {
+        memcpy(&local_addr->ip.v6,
+               &((struct in6_pktinfo *)CMSG_DATA(cmsg))->ipi6_addr,
+               sizeof(struct in6_addr));
+    }
+
+    return 0;
+}
+
+static
+void mud_ctrl_path (struct mud *mud, enum mud_msg msg, struct path *path,
+                    uint64_t now)
+{
+    struct session *session = path->session;
+
+    struct {
+        unsigned char cid[MUD_SID_SIZE];
+        unsigned char zero[MUD_U48_SIZE];
+        unsigned char time[MUD_U48_SIZE];
+        unsigned char data[MUD_SID_SIZE+128+MUD_MAC_SIZE];
+    } ctrl;
+
+    size_t cid_size = mud_cid_size(mud);
+    size_t size = 0;
+
+    mud_write32(ctrl.cid, session->id);
+    memset(ctrl.zero, 0, MUD_U48_SIZE);
+    mud_write48(ctrl.time, now);
+
+    if (mud->sessions.enabled && !cid_size) {
+        mud_write32(ctrl.data, session->id);
+        size = MUD_SID_SIZE;
+    }
+
+    unsigned char *data = ctrl.data+size;
+
+    switch (msg) {
+    case mud_pong:
+        mud_write48(data, path->sdt);
+        mud_write48(&data[MUD_U48_SIZE], path->rdt);
+        mud_write48(&data[2*MUD_U48_SIZE], path->rst);
+        size += MUD_U48_SIZE*3;
+        break;
+    case mud_keyx:
+        memcpy(data, &session->crypto.public, sizeof(session->crypto.public));
+        size += sizeof(session->crypto.public);
+        break;
+    case mud_mtux:
+        mud_write48(data, (uint64_t)mud->mtu.local);
+        size += MUD_U48_SIZE;
+        break;
+    case mud_bakx:
+        data[0] = (unsigned char)path->bak.local;
+        size += 1;
+        break;
+    }
+
+    unsigned char *head = ctrl.cid+MUD_SID_SIZE-cid_size;
+
+    struct crypto_opt opt = {
+        .dst = ctrl.data+size,
+        .ad  = { .data = head,
+                 .size = size+2*MUD_U48_SIZE+cid_size },
+    };
+
+    size += 2*MUD_U48_SIZE+cid_size+MUD_MAC_SIZE;
+
+    mud_encrypt_opt(&session->crypto.private, &opt);
+    mud_send_path(mud, path, now, head, size, 0);
+}
+
+static
+unsigned char mud_key_tag (const unsigned char *key)
+{
+    unsigned char hash[crypto_generichash_BYTES_MIN];
+
+    crypto_generichash(hash, sizeof(hash), key, MUD_KEY_SIZE, NULL, 0);
+
+    return hash[0];
+}
+
+static
+void mud_recv_keyx (struct mud *mud, struct path *path, uint64_t now,
+                    unsigned char *data)
+{
+    struct session *session = path->session;
+    struct public public;
+
+    memcpy(&public, data, sizeof(public));
+
+    int sync_send = memcmp(public.recv, session->crypto.public.send,
+                           sizeof(public.recv));
+
+    memcpy(public.recv, session->crypto.public.send, sizeof(public.recv));
+    memcpy(session->crypto.public.recv, public.send, sizeof(public.send));
+
+    if (sync_send)
+        session->crypto.pending.path = path;
+
+    memcpy(session->crypto.pending.secret, session->crypto.secret,
+           sizeof(session->crypto.pending.secret));
+
+    session->crypto.pending.public = public;
+    session->crypto.pending.time = now;
+    session->crypto.pending.use_next = !sync_send;
+    session->crypto.pending.ready = 1;
+    session->crypto.pending.seq++;
+
+    MUD_STORE(mud->sessions.pending, 1);
+}
+
+static
+int mud_keyx_derive (struct crypto_key *key, const unsigned char *secret,
+                     const struct public *public, const unsigned char *psk)
+{
+    struct {
+        unsigned char secret[crypto_scalarmult_BYTES];
+        struct public public;
+    } shared_send, shared_recv;
+
+    shared_recv.public = *public;
+
+    if (crypto_scalarmult(shared_recv.secret, secret, shared_recv.public.send))
+        return -1;
+
+    memcpy(shared_send.secret, shared_recv.secret,
+           sizeof(shared_send.secret));
+
+    memcpy(shared_send.public.send, shared_recv.public.recv,
+           sizeof(shared_send.public.send));
+
+    memcpy(shared_send.public.recv, shared_recv.public.send,
+           sizeof(shared_send.public.recv));
+
+    crypto_generichash(key->encrypt.key, MUD_KEY_SIZE,
+                       (unsigned char *)&shared_send, sizeof(shared_send),
+                       psk, MUD_KEY_SIZE);
+
+    crypto_generichash(key->decrypt.key, MUD_KEY_SIZE,
+                       (unsigned char *)&shared_recv, sizeof(shared_recv),
+                       psk, MUD_KEY_SIZE);
+
+    unsigned send_flags = shared_recv.public.recv[MUD_PKEY_SIZE-1];
+    unsigned recv_flags = shared_recv.public.send[MUD_PKEY_SIZE-1];
+
+    if (send_flags & recv_flags & MUD_PKEY_EXT) {
+        key->suite = mud_suite(send_flags & recv_flags);
+        key->ctr = !!(send_flags & recv_flags & MUD_PKEY_CTR);
+        key->epoch = !!(send_flags & recv_flags & MUD_PKEY_EPOCH);
+    } else {
+        key->suite = mud_suite(((send_flags == 1) && (recv_flags == 1)) ?
+                               MUD_PKEY_AES : 0);
+        key->ctr = 0;
+        key->epoch = 0;
+    }
+
+    key->encrypt.tag = mud_key_tag(key->encrypt.key);
+    key->decrypt.tag = mud_key_tag(key->decrypt.key);
+    key->nonce = 0;
+
+    if (key->suite->init)
+        key->suite->init(key);
+
+    return 0;
+}
+
+static
+void mud_keyx_task (void *arg, unsigned i)
+{
+    struct keyx_job *job = &((struct keyx_job *)arg)[i];
+
+    if (job->spare) {
+        randombytes_buf(job->spare_secret, sizeof(job->spare_secret));
+        crypto_scalarmult_base(job->spare_public, job->spare_secret);
+    }
+
+    if (job->derive)
+        job->ret = mud_keyx_derive(&job->key, job->secret,
+                                   &job->public, job->psk);
+}
+
+static
+void mud_keyx_install (struct mud *mud, struct session *session,
+                       struct keyx_job *job)
+{
+    struct crypto_key *key = &session->crypto.next;
+
+    session->crypto.pending.ready = 0;
+    session->crypto.use_next = session->crypto.pending.use_next;
+
+    mud_key_sync(&session->crypto.current, key);
+
+    if (!job->ret) {
+        mud_key_sync(&job->key, key);
+        mud_key_sync(&job->key, &session->crypto.current);
+
+        *key = job->key;
+        session->crypto.recv_time = session->crypto.pending.time;
+    }
+
+    if (session->crypto.pending.path) {
+        mud_ctrl_path(mud, mud_keyx, session->crypto.pending.path,
+                      mud_now(mud));
+        session->crypto.pending.path = NULL;
+    }
+}
+
+static
+unsigned mud_keyx_collect (struct mud *mud)
+{
+    unsigned count = 0;
+    size_t i;
+
+    mud_lock(mud, 1);
+    MUD_STORE(mud->sessions.pending, 0);
+
+    for (i = 0; i < mud->sessions.size; i++) {
+        struct session *session = mud->sessions.slot[i];
+
+        if (!session)
+            continue;
+
+        int derive = session->crypto.pending.ready;
+        int spare = !session->crypto.spare.ready;
+
+        if ((!derive) && (!spare))
+            continue;
+
+        if (count == MUD_KEYX_BATCH) {
+            MUD_STORE(mud->sessions.pending, 1);
+            break;
+        }
+
+        struct keyx_job *job = &mud->keyx.job[count++];
+
+        job->session = session;
+        job->id = session->id;
+        job->seq = session->crypto.pending.seq;
+        job->derive = derive;
+        job->spare = spare;
+        job->ret = -1;
+
+        if (!derive)
+            continue;
+
+        memcpy(job->secret, session->crypto.pending.secret,
+               sizeof(job->secret));
+        memcpy(job->psk, session->crypto.private.encrypt.key,
+               sizeof(job->psk));
+
+        job->public = session->crypto.pending.public;
+    }
+
+    mud_unlock(mud);
+
+    return count;
+}
+
+static
+void mud_keyx_finish (struct mud *mud)
+{
+    unsigned i;
+
+    mud_lock(mud, 1);
+
+    for (i = 0; i < mud->keyx.count; i++) {
+        struct keyx_job *job = &mud->keyx.job[i];
+        struct session *session = mud_session(mud, job->id);
+
+        if (session != job->session)
+            continue;
+
+        if ((job->spare) && (!session->crypto.spare.ready)) {
+            memcpy(session->crypto.spare.secret, job->spare_secret,
+                   sizeof(session->crypto.spare.secret));
+            memcpy(session->crypto.spare.public, job->spare_public,
+                   sizeof(session->crypto.spare.public));
+            session->crypto.spare.ready = 1;
+        }
+
+        if ((job->derive) && (session->crypto.pending.ready) &&
+            (session->crypto.pending.seq == job->seq))
+            mud_keyx_install(mud, session, job);
+    }
+
+    MUD_STORE(mud->timer.deadline, 0);
+    mud_unlock(mud);
+
+    MUD_STORE(mud->keyx.count, 0);
+}
+
+static
+int mud_keyx_trylock (struct mud *mud)
+{
+#if defined MUD_POOL
+    return !__atomic_exchange_n(&mud->keyx.busy, 1, __ATOMIC_ACQUIRE);
+#else
+    return mud->keyx.busy ? 0 : (mud->keyx.busy = 1);
+#endif
+}
+
+static
+void mud_keyx_unlock (struct mud *mud)
+{
+#if defined MUD_POOL
+    __atomic_store_n(&mud->keyx.busy, 0, __ATOMIC_RELEASE);
+#else
+    mud->keyx.busy = 0;
+#endif
+}
+
+static
+int mud_keyx_done (struct mud *mud)
+{
+#if defined MUD_POOL
+    return __atomic_load_n(&mud->keyx.done, __ATOMIC_ACQUIRE) != 0;
+#else
+    return mud->keyx.done != 0;
+#endif
+}
+
+static
+void mud_keyx_poll (struct mud *mud, int wait)
+{
+    if ((!MUD_LOAD(mud->sessions.pending)) && (!MUD_LOAD(mud->keyx.count)))
+        return;
+
+    if ((!MUD_LOAD(mud->keyx.timers)) && (!mud->pool.count))
+        wait = 1;
+
+    if (!mud_keyx_trylock(mud))
+        return;
+
+    for (;;) {
+        if (!mud->keyx.count) {
+            if (!MUD_LOAD(mud->sessions.pending))
+                break;
+
+            mud->keyx.done = 0;
+            mud->keyx.posted = 0;
+            MUD_STORE(mud->keyx.count, mud_keyx_collect(mud));
+
+            if (!mud->keyx.count)
+                break;
+        }
+
+        if (!mud->keyx.posted)
+            mud->keyx.posted = mud_pool_post(mud, mud_keyx_task, mud->keyx.job,
+                                             mud->keyx.count, &mud->keyx.done);
+
+        if (!mud->keyx.posted) {
+            if (!wait)
+                break;
+
+            unsigned i;
+
+            for (i = 0; i < mud->keyx.count; i++)
+                mud_keyx_task(mud->keyx.job, i);
+
+            mud->keyx.posted = 1;
+            mud->keyx.done = 1;
+        }
+
+        if (wait) {
+            while (!mud_keyx_done(mud))
+                sched_yield();
+        }
+
+        if (!mud_keyx_done(mud))
+            break;
+
+        mud_keyx_finish(mud);
+    }
+
+    mud_keyx_unlock(mud);
+}
+
+static
+int mud_ctrl_size (size_t size)
+{
+    return (size == MUD_PACKET_SIZEOF(MUD_U48_SIZE)) ||
+           (size == MUD_PONG_SIZE) || (size == MUD_KEYX_SIZE) ||
+           (size == MUD_MTUX_SIZE) || (size == MUD_BAKX_SIZE);
+}
+
+static
+int mud_filter_allow (struct mud *mud, uint64_t now)
+{
+    if (!mud->filter.rate)
+        return 1;
+
+    uint64_t max = mud->filter.rate*MUD_ONE_SEC;
+    uint64_t elapsed = MUD_ONE_SEC;
+
+    if (mud->filter.time && (now >= mud->filter.time) &&
+        (now-mud->filter.time < MUD_ONE_SEC))
+        elapsed = now-mud->filter.time;
+
+    mud->filter.time = now;
+    mud->filter.tokens += elapsed*mud->filter.rate;
+
+    if (mud->filter.tokens > max)
+        mud->filter.tokens = max;
+
+    if (mud->filter.tokens < MUD_ONE_SEC)
+        return 0;
+
+    mud->filter.tokens -= MUD_ONE_SEC;
+
+    return 1;
+}
+
+static
+struct session *mud_recv_session (struct mud *mud, unsigned char *packet,
+                                  int mud_packet, struct ipaddr *local_addr,
+                                  struct sockaddr_storage *addr,
+                                  struct path **path)
+{
+    *path = mud_path(mud, NULL, local_addr, (struct sockaddr *)addr, 0);
+
+    if (mud->sessions.cid)
+        return mud_session(mud, mud_read32(packet));
+
+    if (!mud_packet)
+        return *path ? (*path)->session : NULL;
+
+    if (mud->sessions.enabled)
+        return mud_session(mud, mud_read32(&packet[MUD_U48_SIZE*2]));
+
+    return mud->session;
+}
+
+static
+int mud_recv_packet (struct mud *mud, uint64_t now,
+                     struct sockaddr_storage *addr, struct ipaddr *local_addr,
+                     unsigned char *packet, size_t packet_size,
+                     void *data, size_t size,
+                     struct path **ret_path, unsigned *ret_session,
+                     struct crypto_job *job)
+{
+    MUD_STAT(mud->stats.rx_packets);
+
+    size_t cid_size = mud_cid_size(mud);
+
+    if (packet_size <= cid_size+MUD_PACKET_MIN_SIZE) {
+        MUD_STAT(mud->stats.drop_size);
+        return 0;
+    }
+
+    unsigned char *hdr = packet+cid_size;
+    uint64_t send_time = mud_read48(hdr);
+    size_t sid_size = (mud->sessions.enabled && !cid_size) ? MUD_SID_SIZE : 0;
+
+    int mud_packet = !send_time;
+
+    if (mud_packet) {
+        if ((packet_size < cid_size+sid_size) ||
+            (!mud_ctrl_size(packet_size-cid_size-sid_size))) {
+            MUD_STAT(mud->stats.drop_size);
+            return 0;
+        }
+
+        send_time = mud_read48(&hdr[MUD_U48_SIZE]);
+    }
+
+    if (mud_abs_diff(now, send_time) >= mud->time_tolerance) {
+        MUD_STAT(mud->stats.drop_time);
+        return 0;
+    }
+
+    mud_lock(mud, mud_packet);
+
+    struct path *path;
+    struct session *session = mud_recv_session(mud, packet, mud_packet,
+                                               local_addr, addr, &path);
+
+    if ((!mud_packet) && (session) && (!path || path->session != session)) {
+        mud_unlock(mud);
+        mud_lock(mud, 1);
+        session = mud_recv_session(mud, packet, mud_packet,
+                                   local_addr, addr, &path);
+    }
+
+    if ((!path) && (!mud_packet) && (!cid_size)) {
+        mud_unlock(mud);
+        MUD_STAT(mud->stats.drop_path);
+        return 0;
+    }
+
+    if ((!session) ||
+        (path && path->state.active && (path->session != session))) {
+        mud_unlock(mud);
+        MUD_STAT(mud->stats.drop_session);
+        return 0;
+    }
+
+    if ((!path) && (!mud_filter_allow(mud, now))) {
+        mud_unlock(mud);
+        MUD_STAT(mud->stats.drop_rate);
+        return 0;
+    }
+
+    int ret = 0;
+    int rotate = 0;
+    int decrypted = 0;
+
+    if (mud_packet) {
+        struct crypto_opt opt = {
+            .dst = packet+packet_size-MUD_MAC_SIZE,
+            .src = { .data = packet+packet_size-MUD_MAC_SIZE,
+                     .size = MUD_MAC_SIZE },
+            .ad  = { .data = packet,
+                     .size = packet_size-MUD_MAC_SIZE },
+        };
+
+        MUD_STAT(mud->stats.aead);
+
+        if (mud_decrypt_opt(&session->crypto.private, &opt)) {
+            mud_unlock(mud);
+            MUD_STAT(mud->stats.drop_auth);
+            return 0;
+        }
+    } else if ((!path) || (path->session != session)) {
+        ret = mud_decrypt(mud, session, data, size, packet, packet_size, &rotate);
+
+        if (ret <= 0) {
+            mud_unlock(mud);
+            MUD_STAT(mud->stats.drop_auth);
+            return 0;
+        }
+
+        decrypted = 1;
+    }
+
+    if (path && (path->session != session)) {
+        mud_path_unlink(mud, path);
+        path = NULL;
+    }
+
+    if (!path) {
+        path = mud_path(mud, session, local_addr, (struct sockaddr *)addr, 1);
+
+        if (!path) {
+            mud_unlock(mud);
+            return 0;
+        }
+
+        mud_path_seed(mud, path);
+    }
+
+    if (path->rdt) {
+        path->rdt = ((now-path->recv_time)+UINT64_C(7)*path->rdt)/UINT64_C(8);
+        path->sdt = ((send_time-path->rst)+UINT64_C(7)*path->sdt)/UINT64_C(8);
+    } else if (path->recv_time) {
+        path->rdt = now-path->recv_time;
+        path->sdt = send_time-path->rst;
+    }
+
+    path->rst = send_time;
+
+    if ((!path->bak.local) && (path->recv_time) &&
+        (mud_timeout(now, path->pong_time, MUD_PONG_TIMEOUT))) {
+        mud_ctrl_path(mud, mud_pong, path, now);
+        path->pong_time = now;
+    }
+
+    MUD_STORE(path->recv_time, now);
+
+    if (ret_session)
+        *ret_session = session->id;
+
+    if (mud_packet) {
+        unsigned char *ctrl = &hdr[MUD_U48_SIZE*2+sid_size];
+        size_t ctrl_size = packet_size-cid_size-sid_size;
+
+        if (ctrl_size == MUD_KEYX_SIZE) {
+            mud_recv_keyx(mud, path, now, ctrl);
+        } else if (ctrl_size == MUD_MTUX_SIZE) {
+            session->mtu.remote = (int)mud_read48(ctrl);
+            if (!path->state.active)
+                mud_ctrl_path(mud, mud_mtux, path, now);
+        } else if (ctrl_size == MUD_PONG_SIZE) {
+            path->r_sdt = mud_read48(ctrl);
+            path->r_rdt = mud_read48(&ctrl[MUD_U48_SIZE]);
+            path->r_rst = mud_read48(&ctrl[MUD_U48_SIZE*2]);
+            path->r_dt = send_time-path->r_rst;
+            path->rtt = now-path->r_rst;
+        } else if (ctrl_size == MUD_BAKX_SIZE) {
+            path->bak.local = 1;
+            path->bak.remote = (int)ctrl[0];
+            if (!path->state.active)
+                mud_ctrl_path(mud, mud_bakx, path, now);
+        }
+
+        if (ret_path)
+            *ret_path = path;
+
+        MUD_STORE(mud->timer.deadline, 0);
+
+        mud_unlock(mud);
+
+        MUD_STAT(mud->stats.rx_ctrl);
+
+        return 0;
+    }
+
+    unsigned id = session->id;
+
+    if ((job) && (!decrypted)) {
+        job->id = id;
+        job->src = packet;
+        job->src_size = packet_size;
+
+        mud_unlock(mud);
+
+        if (ret_path)
+            *ret_path = path;
+
+        return 0;
+    }
+
+    if (!decrypted) {
+        ret = mud_decrypt(mud, session, data, size, packet, packet_size, &rotate);
+
+        if (ret == -1)
+            MUD_STORE(session->crypto.bad_key, 1);
+    }
+
+    mud_unlock(mud);
+
+    if (ret == -1) {
+        MUD_STAT(mud->stats.drop_auth);
+        MUD_STORE(mud->timer.deadline, 0);
+        return 0;
+    }
+
+    if (rotate) {
+        mud_lock(mud, 1);
+
+        session = mud_session(mud, id);
+
+        if (session)
+            mud_keyx_rotate(mud, session);
+
+        mud_unlock(mud);
+    }
+
+    MUD_STAT(mud->stats.rx_data);
+
+    if (ret_path)
+        *ret_path = path;
+
+    return ret;
+}
+
+static
+size_t mud_gro_size (struct msghdr *msg)
+{
+#if defined MUD_GRO
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+
+    for (; cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if ((cmsg->cmsg_level == IPPROTO_UDP) &&
+            (cmsg->cmsg_type == UDP_GRO)) {
+            int size;
+            memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+            return (size > 0) ? (size_t)size : 0;
+        }
+    }
+#endif
+    return 0;
+}
+
+static
+int mud_recv_fill (struct mud *mud, int fd, struct rx *rx,
+                   unsigned count, int flags)
+{
+    if (count > rx->max)
+        count = rx->max;
+
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        rx->iov[i].iov_base = rx->data+i*rx->size;
+        rx->iov[i].iov_len = rx->size;
+
+        rx->msg[i].msg_hdr = (struct msghdr) {
+            .msg_name = &rx->addr[i],
+            .msg_namelen = sizeof(rx->addr[i]),
+            .msg_iov = &rx->iov[i],
+            .msg_iovlen = 1,
+            .msg_control = rx->ctrl[i],
+            .msg_controllen = sizeof(rx->ctrl[i]),
+        };
+    }
+
+    int n = mud_recvmmsg(fd, rx->msg, count, flags);
+
+    if (n <= 0)
+        return -1;
+
+    rx->count = (unsigned)n;
+    rx->index = 0;
+    rx->offset = 0;
+    rx->now = mud_now(mud);
+
+    return 0;
+}
+
+static
+void mud_decrypt_task (void *arg, unsigned i)
+{
+    struct crypto_batch *batch = (struct crypto_batch *)arg;
+    struct crypto_job *job = &batch->job[i];
+
+    job->rotate = 0;
+    job->ret = job->session
+             ? mud_decrypt(batch->mud, job->session, NULL, 0,
+                           job->src, job->src_size, &job->rotate)
+             : 0;
+}
+
+static
+void mud_recv_jobs (struct mud *mud, struct rx *rx,
+                    struct mud_packet *packet, unsigned *ret)
+{
+    unsigned count = rx->job.count;
+    unsigned i;
+
+    if (!count)
+        return;
+
+    rx->job.count = 0;
+
+    struct crypto_batch batch = {
+        .mud = mud,
+        .job = rx->job.data,
+    };
+
+    mud_lock(mud, 0);
+
+    for (i = 0; i < count; i++)
+        rx->job.data[i].session = mud_session(mud, rx->job.data[i].id);
+
+    mud_pool_run(mud, mud_decrypt_task, &batch, count);
+
+    for (i = 0; i < count; i++) {
+        if (rx->job.data[i].ret == -1)
+            MUD_STORE(rx->job.data[i].session->crypto.bad_key, 1);
+    }
+
+    mud_unlock(mud);
+
+    for (i = 0; i < count; i++) {
+        struct crypto_job *job = &rx->job.data[i];
+
+        if (job->ret <= 0) {
+            if (job->ret == -1) {
+                MUD_STAT(mud->stats.drop_auth);
+                MUD_STORE(mud->timer.deadline, 0);
+            }
+            continue;
+        }
+
+        if (job->rotate) {
+            mud_lock(mud, 1);
+
+            struct session *session = mud_session(mud, job->id);
+
+            if (session)
+                mud_keyx_rotate(mud, session);
+
+            mud_unlock(mud);
+        }
+
+        unsigned char *data = job->src+job->src_size-MUD_MAC_SIZE-job->ret;
+        size_t size = (size_t)job->ret;
+
+        if (rx->view) {
+            packet[*ret].data = data;
+        } else if (size <= packet[*ret].size) {
+            memcpy(packet[*ret].data, data, size);
+        } else {
+            MUD_STAT(mud->stats.drop_size);
+            continue;
+        }
+
+        MUD_STAT(mud->stats.rx_data);
+
+        packet[*ret].session = job->id;
+        packet[(*ret)++].size = size;
+    }
+}
+
+static
+int mud_recv_segments (struct mud *mud, struct rx *rx,
+                       struct sockaddr_storage *addr,
+                       unsigned char *data, size_t size,
+                       struct mud_packet *packet, unsigned *ret, unsigned count,
+                       int defer)
+{
+    while (*ret+rx->job.count < count) {
+        size_t packet_size = size-rx->offset;
+
+        if ((rx->segment) && (packet_size > rx->segment))
+            packet_size = rx->segment;
+
+        unsigned char *p = data+rx->offset;
+
+        rx->offset += packet_size;
+
+        if (packet_size > MUD_PACKET_MIN_SIZE) {
+            struct crypto_job *job = NULL;
+
+            if (defer) {
+                if (rx->job.count == MUD_BATCH_SIZE)
+                    mud_recv_jobs(mud, rx, packet, ret);
+
+                job = &rx->job.data[rx->job.count];
+                job->src = NULL;
+            }
+
+            int r = mud_recv_packet(mud, rx->now, addr, &rx->local_addr,
+                                    p, packet_size,
+                                    rx->view ? NULL : packet[*ret].data,
+                                    rx->view ? 0 : packet[*ret].size,
+                                    NULL, &packet[*ret].session, job);
+            if ((job) && (job->src)) {
+                rx->job.count++;
+            } else if (r > 0) {
+                if (rx->view)
+                    packet[*ret].data = p+packet_size-MUD_MAC_SIZE-r;
+                packet[(*ret)++].size = (size_t)r;
+            }
+        }
+
+        if (rx->offset >= size) {
+            rx->offset = 0;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+#if defined MUD_IO_URING
+static
+int mud_uring_recv (struct mud *mud, struct mud_packet *packet, unsigned count)
+{
+    struct io_uring *ring = &mud->uring.ring;
+    unsigned ret = 0;
+    int wait = 1;
+
+    while (mud->uring.lease_count)
+        mud_uring_recycle(mud, mud->uring.lease[--mud->uring.lease_count]);
+
+    mud->rx.now = mud_now(mud);
+
+    while (ret < count) {
+        struct io_uring_cqe *cqe;
+
+        if ((!mud->uring.armed) && (mud_uring_arm(mud)))
+            break;
+
+        if (io_uring_peek_cqe(ring, &cqe)) {
+            if (ret || !wait)
+                break;
+
+            int r = io_uring_submit_and_wait(ring, 1);
+
+            if (r < 0) {
+                errno = -r;
+                return -1;
+            }
+
+            mud->rx.now = mud_now(mud);
+            wait = 0;
+            continue;
+        }
+
+        uint64_t data = io_uring_cqe_get_data64(cqe);
+
+        if (data != MUD_URING_RECV) {
+            mud->uring.free[mud->uring.free_count++] = (unsigned)data;
+            io_uring_cqe_seen(ring, cqe);
+            continue;
+        }
+
+        if (!mud->rx.offset && !(cqe->flags & IORING_CQE_F_MORE))
+            mud->uring.armed = 0;
+
+        if ((cqe->res <= 0) || !(cqe->flags & IORING_CQE_F_BUFFER)) {
+            io_uring_cqe_seen(ring, cqe);
+            continue;
+        }
+
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        unsigned char *buf = mud->uring.data+bid*mud->uring.size;
+
+        struct io_uring_recvmsg_out *out =
+            io_uring_recvmsg_validate(buf, cqe->res, &mud->uring.msg);
+
+        struct sockaddr_storage *addr = &mud->uring.addr;
+
+        if ((out) && (!mud->rx.offset)) {
+            unsigned char *name = io_uring_recvmsg_name(out);
+            size_t addr_size = out->namelen;
+
+            if (addr_size > sizeof(*addr))
+                addr_size = sizeof(*addr);
+
+            memset(addr, 0, sizeof(*addr));
+            memcpy(addr, name, addr_size);
+            mud_unmapv4((struct sockaddr *)addr);
+
+            struct msghdr msg = {
+                .msg_control = name+mud->uring.msg.msg_namelen,
+                .msg_controllen = out->controllen,
+            };
+
+            if (mud_localaddr(&mud->rx.local_addr, &msg, addr->ss_family))
+                out = NULL;
+
+            mud->rx.segment = mud_gro_size(&msg);
+        }
+
+        if (out) {
+            unsigned char *payload = io_uring_recvmsg_payload(out, &mud->uring.msg);
+            size_t size = io_uring_recvmsg_payload_length(out, cqe->res,
+                                                          &mud->uring.msg);
+
+            if (!mud_recv_segments(mud, &mud->rx, addr, payload, size,
+                                   packet, &ret, count, 0))
+                break;
+        }
+
+        if (mud->rx.view) {
+            mud->uring.lease[mud->uring.lease_count++] = bid;
+        } else {
+            mud_uring_recycle(mud, bid);
+        }
+
+        io_uring_cqe_seen(ring, cqe);
+    }
+
+    if (!mud->uring.armed)
+        mud_uring_arm(mud);
+
+    io_uring_submit(ring);
+
+    return (int)ret;
+}
+#endif
+
+static
+int mud_recv_rx (struct mud *mud, int fd, struct rx *rx,
+                 struct mud_packet *packet, unsigned count)
+{
+    unsigned ret = 0;
+    int fill = 1;
+    int defer = mud->pool.count > 0;
+
+    while (ret+rx->job.count < count) {
+        if (rx->index >= rx->count) {
+            mud_recv_jobs(mud, rx, packet, &ret);
+
+            if ((!fill) || (ret >= count) || (rx->view && ret))
+                break;
+
+            if (mud_recv_fill(mud, fd, rx, count-ret, ret ? MSG_DONTWAIT : 0)) {
+                if (!ret)
+                    return -1;
+                break;
+            }
+
+            fill = 0;
+            continue;
+        }
+
+        unsigned i = rx->index;
+        struct msghdr *msg = &rx->msg[i].msg_hdr;
+        struct sockaddr_storage *addr = &rx->addr[i];
+
+        if (!rx->offset) {
+            mud_unmapv4((struct sockaddr *)addr);
+
+            if (mud_localaddr(&rx->local_addr, msg, addr->ss_family)) {
+                rx->index++;
+                continue;
+            }
+
+            rx->segment = mud_gro_size(msg);
+        }
+
+        if (mud_recv_segments(mud, rx, addr, rx->iov[i].iov_base,
+                              rx->msg[i].msg_len, packet, &ret, count, defer))
+            rx->index++;
+    }
+
+    mud_recv_jobs(mud, rx, packet, &ret);
+
+    return (int)ret;
+}
+
+int mud_recv_batch (struct mud *mud, struct mud_packet *packet, unsigned count)
+{
+    if (!packet) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mud_keyx_poll(mud, 0);
+
+#if defined MUD_IO_URING
+    if (mud->uring.enabled)
+        return mud_uring_recv(mud, packet, count);
+#endif
+
+    int fd = mud->fd;
+
+#if defined MUD_CONNECT
+    if ((mud->conn.enabled) && (mud->rx.index >= mud->rx.count)) {
+        struct epoll_event ev;
+        int n = epoll_wait(mud->conn.epoll, &ev, 1, 0);
+
+        if (n <= 0)
+            return n;
+
+        fd = ev.data.fd;
+    }
+#endif
+
+    return mud_recv_rx(mud, fd, &mud->rx, packet, count);
+}
+
+int mud_recv_view (struct mud *mud, struct mud_packet *packet, unsigned count)
+{
+    mud->rx.view = 1;
+    int ret = mud_recv_batch(mud, packet, count);
+    mud->rx.view = 0;
+
+    return ret;
+}
+
+int mud_recv_shard (struct mud *mud, unsigned shard,
+                    struct mud_packet *packet, unsigned count)
+{
+    if (!shard)
+        return mud_recv_batch(mud, packet, count);
+
+    if (!packet || (shard >= mud->shard.count)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct shard *s = &mud->shard.data[shard-1];
+
+    mud_keyx_poll(mud, 0);
+
+    return mud_recv_rx(mud, s->fd, &s->rx, packet, count);
+}
+
+int mud_recv_frame (struct mud *mud, void *frame, size_t frame_size,
+                    void *data, size_t size)
+{
+    if (!frame) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mud_keyx_poll(mud, 0);
+
+    if (frame_size < MUD_ETH_SIZE)
+        return 0;
+
+    unsigned char *eth = frame;
+    unsigned char *ip = eth+MUD_ETH_SIZE;
+    unsigned char *udp;
+    size_t udp_size = frame_size-MUD_ETH_SIZE;
+
+    struct sockaddr_storage addr;
+    struct ipaddr local_addr;
+
+    memset(&addr, 0, sizeof(addr));
+
+    switch (mud_read16(&eth[12])) {
+    case 0x0800: {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+        size_t hdr_size = 4U*(ip[0]&15U);
+
+        if ((udp_size < MUD_IP4_SIZE) || ((ip[0]>>4) != 4) ||
+            (ip[9] != IPPROTO_UDP) || (mud_read16(&ip[6])&0x3FFF) ||
+            (hdr_size < MUD_IP4_SIZE) || (mud_read16(&ip[2]) > udp_size) ||
+            (mud_read16(&ip[2]) < hdr_size+MUD_UDP_SIZE))
+            return 0;
+
+        udp_size = mud_read16(&ip[2])-hdr_size;
+        udp = ip+hdr_size;
+
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, &ip[12], sizeof(sin->sin_addr));
+        memcpy(&sin->sin_port, &udp[0], sizeof(sin->sin_port));
+
+        local_addr.family = AF_INET;
+        memcpy(&local_addr.ip.v4, &ip[16], sizeof(local_addr.ip.v4));
+        break;
+    }
+    case 0x86DD: {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&addr;
+
+        if ((udp_size < MUD_IP6_SIZE) || ((ip[0]>>4) != 6) ||
+            (ip[6] != IPPROTO_UDP) ||
+            (mud_read16(&ip[4]) > udp_size-MUD_IP6_SIZE) ||
+            (mud_read16(&ip[4]) < MUD_UDP_SIZE))
+            return 0;
+
+        udp_size = mud_read16(&ip[4]);
+        udp = ip+MUD_IP6_SIZE;
+
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, &ip[8], sizeof(sin6->sin6_addr));
+        memcpy(&sin6->sin6_port, &udp[0], sizeof(sin6->sin6_port));
+
+        local_addr.family = AF_INET6;
+        memcpy(&local_addr.ip.v6, &ip[24], sizeof(local_addr.ip.v6));
+        break;
+    }
+    default:
+        return 0;
+    }
+
+    if ((mud_read16(&udp[2]) != (unsigned)mud->port) ||
+        (mud_read16(&udp[4]) > udp_size) ||
+        (mud_read16(&udp[4]) <= MUD_UDP_SIZE+MUD_PACKET_MIN_SIZE))
+        return 0;
+
+    mud_unmapv4((struct sockaddr *)&addr);
+
+    struct path *path = NULL;
+
+    int ret = mud_recv_packet(mud, mud_now(mud), &addr, &local_addr,
+                              udp+MUD_UDP_SIZE,
+                              mud_read16(&udp[4])-MUD_UDP_SIZE,
+                              data, size, &path, NULL, NULL);
+
+    if (path) {
+        memcpy(&path->eth.data[0], &eth[6], 6);
+        memcpy(&path->eth.data[6], &eth[0], 6);
+        memcpy(&path->eth.data[12], &eth[12], 2);
+        path->eth.size = MUD_ETH_SIZE;
+    }
+
+    mud_flush(mud);
+
+    return ret;
+}
+
+static
+int mud_input_addr (struct sockaddr_storage *addr, const struct sockaddr *src)
+{
+    memset(addr, 0, sizeof(*addr));
+
+    if (!src)
+        return 1;
+
+    switch (src->sa_family) {
+    case AF_INET:
+        memcpy(addr, src, sizeof(struct sockaddr_in));
+        break;
+    case AF_INET6:
+        memcpy(addr, src, sizeof(struct sockaddr_in6));
+        break;
+    default:
+        return 1;
+    }
+
+    mud_unmapv4((struct sockaddr *)addr);
+
+    return 0;
+}
+
+int mud_input (struct mud *mud, uint64_t now, struct mud_datagram *dgram,
+               struct mud_packet *packet, unsigned count)
+{
+    if ((!dgram) || (!packet)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mud_keyx_poll(mud, 0);
+
+    now = now ? now&((UINT64_C(1)<<48)-1) : mud_now(mud);
+
+    unsigned i, ret = 0;
+
+    for (i = 0; i < count; i++) {
+        struct sockaddr_storage addr, local;
+        struct ipaddr local_addr;
+
+        if (mud_input_addr(&addr, dgram[i].addr))
+            continue;
+
+        memset(&local_addr, 0, sizeof(local_addr));
+        local_addr.family = addr.ss_family;
+
+        if (!mud_input_addr(&local, dgram[i].local)) {
+            local_addr.family = local.ss_family;
+
+            if (local.ss_family == AF_INET) {
+                memcpy(&local_addr.ip.v4,
+                       &((struct sockaddr_in *)&local)->sin_addr,
+                       sizeof(local_addr.ip.v4));
+            } else {
+                memcpy(&local_addr.ip.v6,
+                       &((struct sockaddr_in6 *)&local)->sin6_addr,
+                       sizeof(local_addr.ip.v6));
+            }
+        }
+
+        int r = mud_recv_packet(mud, now, &addr, &local_addr,
+                                dgram[i].data, dgram[i].size,
+                                packet[ret].data, packet[ret].size,
+                                NULL, &packet[ret].session, NULL);
+        if (r > 0)
+            packet[ret++].size = (size_t)r;
+    }
+
+    mud_flush(mud);
+
+    return (int)ret;
+}
+
+int mud_output (struct mud *mud, struct mud_datagram *dgram, unsigned count)
+{
+    if ((!dgram) || (!mud->io.enabled)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&mud->io.mutex);
+
+    unsigned i, n = mud->io.count;
+
+    if (n > count)
+        n = count;
+
+    for (i = 0; i < n; i++) {
+        struct io_slot *slot = &mud->io.slot[(mud->io.head+i)%MUD_IO_SIZE];
+
+        dgram[i] = (struct mud_datagram) {
+            .data = slot->data,
+            .size = slot->size,
+            .ctrl = slot->ctrl_size ? slot->ctrl : NULL,
+            .ctrl_size = slot->ctrl_size,
+            .addr = (struct sockaddr *)&slot->addr,
+            .local = (struct sockaddr *)&slot->local,
+        };
+    }
+
+    mud->io.head = (mud->io.head+n)%MUD_IO_SIZE;
+    mud->io.count -= n;
+    mud->io.lease = n;
+
+    pthread_mutex_unlock(&mud->io.mutex);
+
+    return (int)n;
+}
+
+int mud_recv (struct mud *mud, void *data, size_t size)
+{
+    struct mud_packet packet = {
+        .data = data,
+        .size = size,
+    };
+
+    int ret = mud_recv_batch(mud, &packet, 1);
+
+    if (ret <= 0)
+        return ret;
+
+    return (int)packet.size;
+}
+
+static
+uint64_t mud_deadline (uint64_t last, uint64_t timeout)
+{
+    return last ? last+timeout : 0;
+}
+
+static
+uint64_t mud_session_timers (struct mud *mud, struct session *session,
+                             uint64_t now)
+{
+    struct path *path;
+
+    mud_path_gc(mud, session, now);
+
+    for (path = session->path; path; path = path->next) {
+        if (!path->state.active) {
+            if ((session->crypto.bad_key) &&
+                (mud_timeout(now, session->crypto.send_time, mud->send_timeout))) {
+                mud_ctrl_path(mud, mud_keyx, path, now);
+                session->crypto.send_time = now;
+                session->crypto.bad_key = 0;
+            }
+        } else {
+            if ((mud_timeout(now, session->crypto.send_time, mud->send_timeout)) &&
+                (mud_timeout(now, session->crypto.recv_time, MUD_KEYX_TIMEOUT))) {
+                mud_ctrl_path(mud, mud_keyx, path, now);
+                session->crypto.send_time = now;
+                continue;
+            }
+
+            if ((!session->mtu.remote) &&
+                (mud_timeout(now, session->mtu.send_time, mud->send_timeout))) {
+                mud_ctrl_path(mud, mud_mtux, path, now);
+                session->mtu.send_time = now;
+                continue;
+            }
+
+            if ((path->bak.local && !path->bak.remote) &&
+                (mud_timeout(now, path->bak.send_time, mud->send_timeout))) {
+                mud_ctrl_path(mud, mud_bakx, path, now);
+                path->bak.send_time = now;
+                continue;
+            }
+
+            if (!path->send_time)
+                mud_ctrl_path(mud, mud_ping, path, now);
+        }
+    }
+
+    uint64_t deadline = UINT64_MAX;
+
+    for (path = session->path; path; path = path->next) {
+        uint64_t next = UINT64_MAX;
+
+        if (!path->state.active) {
+            if (session->crypto.bad_key)
+                next = mud_deadline(session->crypto.send_time, mud->send_timeout);
+
+            if (mud->gc.idle) {
+                uint64_t idle = mud_deadline(path->recv_time, mud->gc.idle);
+
+                if (idle < next)
+                    next = idle;
+            }
+        } else {
+            uint64_t keyx = mud_deadline(session->crypto.recv_time, MUD_KEYX_TIMEOUT);
 
-        path->tc = CMSG_DATA(cmsg);
-        path->ctrl.size = CMSG_SPACE(MUD_PKTINFO_SIZE)
-                        + CMSG_SPACE(sizeof(int));
-    }
+            next = mud_deadline(session->crypto.send_time, mud->send_timeout);
 
-    if (addr->sa_family == AF_INET6) {
-        memmove(&path->addr, addr, sizeof(struct sockaddr_in6));
+            if (next < keyx)
+                next = keyx;
 
-        cmsg->cmsg_level = IPPROTO_IPV6;
-        cmsg->cmsg_type = IPV6_PKTINFO;
-        cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
+            if (!session->mtu.remote) {
+                uint64_t mtux = mud_deadline(session->mtu.send_time, mud->send_timeout);
 
-        memcpy(&((struct in6_pktinfo *)CMSG_DATA(cmsg))->ipi6_addr,
-               &local_addr->ip.v6,
-               sizeof(struct in6_addr));
+                if (mtux < next)
+                    next = mtux;
+            }
 
-        cmsg = CMSG_NXTHDR(&msg, cmsg);
+            if (path->bak.local && !path->bak.remote) {
+                uint64_t bakx = mud_deadline(path->bak.send_time, mud->send_timeout);
 
-        cmsg->cmsg_level = IPPROTO_IPV6;
-        cmsg->cmsg_type = IPV6_TCLASS;
-        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+                if (bakx < next)
+                    next = bakx;
+            }
 
-        path->tc = CMSG_DATA(cmsg);
-        path->ctrl.size = CMSG_SPACE(sizeof(struct in6_pktinfo))
-                        + CMSG_SPACE(sizeof(int));
+            if (!path->send_time)
+                next = 0;
+        }
+
+        if (next < deadline)
+            deadline = next;
     }
+
+    return deadline;
 }
 
 static
-struct path *mud_path (struct mud *mud, struct ipaddr *local_addr,
-                       struct sockaddr *addr, int create)
+void mud_ctrl_timers (struct mud *mud, uint64_t now)
 {
-    if (local_addr->family != addr->sa_family)
-        return NULL;
-
-    struct path *path;
+    uint64_t deadline = UINT64_MAX;
+    size_t i;
 
-    for (path = mud->path; path; path = path->next) {
-        if (mud_cmp_ipaddr(local_addr, &path->local_addr))
+    for (i = 0; i < mud->sessions.size; i++) {
+        if (!mud->sessions.slot[i])
             continue;
 
-        if (mud_cmp_addr(addr, (struct sockaddr *)&path->addr))
-            continue;
+        uint64_t next = mud_session_timers(mud, mud->sessions.slot[i], now);
 
-        break;
+        if (next < deadline)
+            deadline = next;
     }
 
-    if (path || !create)
-        return path;
-
-    path = calloc(1, sizeof(struct path));
-
-    if (!path)
-        return NULL;
-
-    mud_set_path(path, local_addr, addr);
-
-    path->next = mud->path;
-    mud->path = path;
-
-    return path;
+    MUD_STORE(mud->timer.deadline, deadline);
 }
 
 static
-int mud_ipaddrinfo (struct ipaddr *ipaddr, const char *name)
+int mud_timer_due (struct mud *mud, uint64_t now)
 {
-    if (!name) {
-        errno = EINVAL;
-        return -1;
-    }
-
-    if (inet_pton(AF_INET, name, &ipaddr->ip.v4) == 1) {
-        ipaddr->family = AF_INET;
-        return 0;
-    }
+    uint64_t deadline = MUD_LOAD(mud->timer.deadline);
 
-    if (inet_pton(AF_INET6, name, &ipaddr->ip.v6) == 1) {
-        ipaddr->family = AF_INET6;
+    if (deadline == UINT64_MAX)
         return 0;
-    }
 
-    return -1;
+    return (now >= deadline) || (deadline-now > MUD_KEYX_TIMEOUT);
 }
 
-int mud_peer (struct mud *mud, const char *name, const char *host, int port, int backup)
+int mud_send_ctrl (struct mud *mud)
 {
-    if (!name || !host || !port) {
-        errno = EINVAL;
-        return -1;
-    }
+    mud_keyx_poll(mud, 0);
 
-    struct ipaddr local_addr;
+    uint64_t now = mud_now(mud);
 
-    if (mud_ipaddrinfo(&local_addr, name))
-        return -1;
+    if (!mud_timer_due(mud, now))
+        return 0;
 
-    struct sockaddr_storage addr;
+    mud_lock(mud, 1);
+    mud_ctrl_timers(mud, now);
+    mud_unlock(mud);
 
-    if (mud_addrinfo(&addr, host, port))
-        return -1;
+    return 0;
+}
 
-    mud_unmapv4((struct sockaddr *)&addr);
+int mud_next_timeout (struct mud *mud)
+{
+    uint64_t deadline = MUD_LOAD(mud->timer.deadline);
 
-    struct path *path = mud_path(mud, &local_addr,
-                                 (struct sockaddr *)&addr, 1);
+    if ((MUD_LOAD(mud->sessions.pending)) || (MUD_LOAD(mud->keyx.count)))
+        return 0;
 
-    if (!path) {
-        errno = ENOMEM;
+    if (deadline == UINT64_MAX)
         return -1;
-    }
 
-    path->state.active = 1;
-    path->bak.local = !!backup;
+    uint64_t now = mud_now(mud);
 
-    return 0;
+    if (mud_timer_due(mud, now))
+        return 0;
+
+    return (int)((deadline-now+MUD_ONE_MSEC-1)/MUD_ONE_MSEC);
 }
 
-int mud_get_key (struct mud *mud, unsigned char *key, size_t *size)
+int mud_process_timers (struct mud *mud)
 {
-    if (!key || !size || (*size < MUD_KEY_SIZE)) {
-        errno = EINVAL;
-        return -1;
-    }
-
-    memcpy(key, mud->crypto.private.encrypt.key, MUD_KEY_SIZE);
-    *size = MUD_KEY_SIZE;
+    MUD_STORE(mud->keyx.timers, 1);
+    mud_keyx_poll(mud, 1);
+    mud_send_ctrl(mud);
+    mud_flush(mud);
 
-    return 0;
+    return mud_next_timeout(mud);
 }
 
-int mud_set_key (struct mud *mud, unsigned char *key, size_t size)
+static
+void mud_sched_init (struct mud *mud, struct tx *tx, struct session *session,
+                     uint64_t now)
 {
-    if (!key || (size < MUD_KEY_SIZE)) {
-        errno = EINVAL;
-        return -1;
-    }
+    struct path *path;
+    size_t n = 0;
+
+    for (path = session->path; path; path = path->next) {
+        struct sched *sched = &tx->sched.data[n++];
+        int64_t limit = MUD_LOAD(path->limit);
+        uint64_t elapsed = now-MUD_LOAD(path->send_time);
 
-    memcpy(mud->crypto.private.encrypt.key, key, MUD_KEY_SIZE);
-    memcpy(mud->crypto.private.decrypt.key, key, MUD_KEY_SIZE);
+        if (limit > (int64_t)elapsed) {
+            limit += path->rtt/2-elapsed;
+        } else {
+            limit = path->rtt/2;
+        }
 
-    mud->crypto.current = mud->crypto.private;
-    mud->crypto.next = mud->crypto.private;
-    mud->crypto.last = mud->crypto.private;
+        sched->path = path;
+        sched->limit = limit;
+        sched->count = 0;
+        sched->probe = (!path->bak.local) &&
+                       (mud_timeout(now, MUD_LOAD(path->recv_time),
+                                    mud->send_timeout));
+    }
 
-    return 0;
+    tx->sched.count = n;
 }
 
-int mud_set_send_timeout_msec (struct mud *mud, unsigned msec)
+static
+struct path *mud_select_path (struct mud *mud, struct tx *tx,
+                              struct session *session, uint64_t now,
+                              int64_t *limit_min)
 {
-    if (!msec) {
-        errno = EINVAL;
-        return -1;
-    }
+    struct path *path_min = NULL;
+    struct path *path_bak = NULL;
+    size_t i;
 
-    mud->send_timeout = msec*MUD_ONE_MSEC;
+    mud_sched_init(mud, tx, session, now);
 
-    return 0;
-}
+    *limit_min = INT64_MAX;
 
-int mud_set_time_tolerance_sec (struct mud *mud, unsigned sec)
-{
-    if (!sec) {
-        errno = EINVAL;
-        return -1;
-    }
+    for (i = 0; i < tx->sched.count; i++) {
+        struct sched *sched = &tx->sched.data[i];
 
-    mud->time_tolerance = sec*MUD_ONE_SEC;
+        if (sched->path->bak.local) {
+            if (!path_bak)
+                path_bak = sched->path;
+            continue;
+        }
 
-    return 0;
+        if ((!sched->probe) && (*limit_min > sched->limit)) {
+            *limit_min = sched->limit;
+            path_min = sched->path;
+        }
+    }
+
+    return path_min ? path_min : path_bak;
 }
 
-int mud_get_mtu (struct mud *mud)
+static
+void mud_send_probes (struct mud *mud, struct tx *tx, uint64_t now,
+                      unsigned char *packet, size_t size, int tc)
 {
-    if ((!mud->mtu.remote) ||
-        (mud->mtu.local < mud->mtu.remote))
-        return mud->mtu.local;
+    size_t i;
+
+    for (i = 0; i < tx->sched.count; i++) {
+        struct sched *sched = &tx->sched.data[i];
+
+        if (!sched->probe)
+            continue;
 
-    return mud->mtu.remote;
+        mud_send_path(mud, sched->path, now, packet, size, tc);
+        MUD_STORE(sched->path->limit, sched->limit);
+    }
 }
 
-int mud_set_mtu (struct mud *mud, int mtu)
+static
+int mud_send_data (struct mud *mud, struct session *session,
+                   unsigned char *packet, size_t packet_max,
+                   const void *data, size_t size, int tc)
 {
-    if ((mtu < 500) ||
-        (mtu > MUD_PACKET_MAX_SIZE-50)) {
-        errno = EINVAL;
+    if (!size)
+        return 0;
+
+    if (size > (size_t)mud_mtu(mud, session)) {
+        errno = EMSGSIZE;
         return -1;
     }
 
-    if (mud->mtu.local != mtu) {
-        mud->mtu.local = mtu;
-        mud->mtu.send_time = UINT64_C(0);
-    }
+    uint64_t now = mud_now(mud);
 
-    return 0;
-}
+    int packet_size = mud_encrypt(mud, session, now, packet, packet_max,
+                                  data, size);
 
-static
-int mud_setup_socket (int fd, int v4, int v6)
-{
-    if ((mud_sso_int(fd, SOL_SOCKET, SO_REUSEADDR, 1)) ||
-        (v4 && mud_sso_int(fd, IPPROTO_IP, MUD_PKTINFO, 1)) ||
-        (v6 && mud_sso_int(fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, 1)) ||
-        (v6 && mud_sso_int(fd, IPPROTO_IPV6, IPV6_V6ONLY, !v4)))
+    if (!packet_size)
         return -1;
 
-#ifdef __linux__
-        if (v4)
-            mud_sso_int(fd, IPPROTO_IP, MUD_DFRAG, MUD_DFRAG_OPT);
-#endif
+    int64_t limit_min;
+    struct path *path_min = mud_select_path(mud, &mud->tx, session,
+                                            now, &limit_min);
 
-//  mud_sso_int(fd, SOL_SOCKET, SO_RCVBUF, 1<<24);
-//  mud_sso_int(fd, SOL_SOCKET, SO_SNDBUF, 1<<24);
+    mud_send_probes(mud, &mud->tx, now, packet, packet_size, tc);
 
-    return 0;
+    if (!path_min)
+        return 0;
+
+    ssize_t ret = mud_send_path(mud, path_min, now, packet, packet_size, tc);
+
+    if (ret == packet_size)
+        MUD_STORE(path_min->limit, limit_min);
+
+    return (int)ret;
 }
 
 static
-int mud_create_socket (int port, int v4, int v6)
+size_t mud_frame_header (struct path *path)
 {
-    struct sockaddr_storage addr;
+    return MUD_ETH_SIZE+MUD_UDP_SIZE+((path->addr.ss_family == AF_INET)
+                                      ? MUD_IP4_SIZE : MUD_IP6_SIZE);
+}
 
-    if (mud_addrinfo(&addr, v6 ? "::" : "0.0.0.0", port))
-        return -1;
+static
+void mud_frame_build (struct mud *mud, struct path *path, unsigned char *frame,
+                      size_t packet_size, int tc)
+{
+    unsigned char *ip = frame+MUD_ETH_SIZE;
+    unsigned char *udp;
+    size_t udp_size = packet_size+MUD_UDP_SIZE;
+    uint32_t sum;
+
+    memcpy(frame, path->eth.data, MUD_ETH_SIZE);
+
+    if (path->addr.ss_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&path->addr;
+
+        udp = ip+MUD_IP4_SIZE;
+
+        memset(ip, 0, MUD_IP4_SIZE);
+        ip[0] = 0x45;
+        ip[1] = (unsigned char)tc;
+        mud_write16(&ip[2], (unsigned)(udp_size+MUD_IP4_SIZE));
+        mud_write16(&ip[6], 0x4000);
+        ip[8] = 64;
+        ip[9] = IPPROTO_UDP;
+        memcpy(&ip[12], &path->local_addr.ip.v4, 4);
+        memcpy(&ip[16], &sin->sin_addr, 4);
+        mud_write16(&ip[10], mud_csum_fold(mud_csum(0, ip, MUD_IP4_SIZE)));
+
+        memcpy(&udp[2], &sin->sin_port, 2);
+        sum = 0;
+    } else {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&path->addr;
 
-    int fd = socket(addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+        udp = ip+MUD_IP6_SIZE;
 
-    if (fd == -1)
-        return -1;
+        ip[0] = (unsigned char)(0x60|((tc>>4)&15));
+        ip[1] = (unsigned char)((tc&15)<<4);
+        ip[2] = ip[3] = 0;
+        mud_write16(&ip[4], (unsigned)udp_size);
+        ip[6] = IPPROTO_UDP;
+        ip[7] = 64;
+        memcpy(&ip[8], &path->local_addr.ip.v6, 16);
+        memcpy(&ip[24], &sin6->sin6_addr, 16);
 
-    if (mud_setup_socket(fd, v4, v6) ||
-        bind(fd, (struct sockaddr *)&addr, mud_addrlen(&addr))) {
-        int err = errno;
-        close(fd);
-        errno = err;
-        return -1;
+        memcpy(&udp[2], &sin6->sin6_port, 2);
+        sum = mud_csum(udp_size+IPPROTO_UDP, &ip[8], 32);
     }
 
-    return fd;
-}
+    mud_write16(&udp[0], (unsigned)mud->port);
+    mud_write16(&udp[4], (unsigned)udp_size);
+    mud_write16(&udp[6], 0);
 
-static
-void mud_keyx_init (struct mud *mud)
-{
-    randombytes_buf(mud->crypto.secret, sizeof(mud->crypto.secret));
-    crypto_scalarmult_base(mud->crypto.public.send, mud->crypto.secret);
-    memset(mud->crypto.public.recv, 0, sizeof(mud->crypto.public.recv));
-    mud->crypto.public.send[MUD_PKEY_SIZE-1] = mud->crypto.aes;
+    if (path->addr.ss_family == AF_INET6) {
+        unsigned csum = mud_csum_fold(mud_csum(sum, udp, udp_size));
+        mud_write16(&udp[6], csum ? csum : 0xFFFF);
+    }
 }
 
-struct mud *mud_create (int port, int v4, int v6, int aes, int mtu)
+int mud_send_frame (struct mud *mud, const void *data, size_t size, int tc,
+                    void *frame, size_t frame_size)
 {
-    if (sodium_init() == -1)
-        return NULL;
+    if (!frame) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mud_send_ctrl(mud);
+    mud_lock(mud, 0);
 
-    struct mud *mud = calloc(1, sizeof(struct mud));
+    int ret = 0;
 
-    if (!mud)
-        return NULL;
+    if (!size)
+        goto flush;
 
-    mud->fd = mud_create_socket(port, v4, v6);
+    struct session *session = mud->session;
 
-    if (mud->fd == -1) {
-        mud_delete(mud);
-        return NULL;
+    if (size > (size_t)mud_mtu(mud, session)) {
+        errno = EMSGSIZE;
+        ret = -1;
+        goto flush;
     }
 
-    mud->send_timeout = MUD_SEND_TIMEOUT;
-    mud->time_tolerance = MUD_TIME_TOLERANCE;
-    mud->mtu.local = mtu;
+    uint64_t now = mud_now(mud);
+    int64_t limit_min;
+    struct path *path = mud_select_path(mud, &mud->tx, session,
+                                        now, &limit_min);
+    size_t hdr_size = MUD_ETH_SIZE+MUD_IP6_SIZE+MUD_UDP_SIZE;
+
+    if (path)
+        hdr_size = mud_frame_header(path);
+
+    if (frame_size < hdr_size) {
+        errno = ENOBUFS;
+        ret = -1;
+        goto flush;
+    }
 
-    unsigned char key[MUD_KEY_SIZE];
+    unsigned char *packet = (unsigned char *)frame+hdr_size;
 
-    randombytes_buf(key, sizeof(key));
-    mud_set_key(mud, key, sizeof(key));
+    int packet_size = mud_encrypt(mud, session, now,
+                                  packet, frame_size-hdr_size, data, size);
 
-    mud->crypto.aes = aes && crypto_aead_aes256gcm_is_available();
-    mud_keyx_init(mud);
+    if (!packet_size) {
+        if (errno != EAGAIN)
+            errno = ENOBUFS;
+        ret = -1;
+        goto flush;
+    }
 
-    return mud;
-}
+    mud_send_probes(mud, &mud->tx, now, packet, packet_size, tc);
 
-int mud_get_fd (struct mud *mud)
-{
-    return mud->fd;
+    if (!path)
+        goto flush;
+
+    if (!path->eth.size) {
+        ret = (int)mud_send_path(mud, path, now, packet, packet_size, tc);
+
+        if (ret == packet_size)
+            MUD_STORE(path->limit, limit_min);
+
+        goto flush;
+    }
+
+    mud_frame_build(mud, path, frame, packet_size, tc);
+
+    MUD_STORE(path->send_time, now);
+    MUD_STORE(path->limit, limit_min);
+
+    ret = (int)hdr_size+packet_size;
+
+flush:
+    mud_unlock(mud);
+    mud_flush(mud);
+
+    return ret;
 }
 
-void mud_delete (struct mud *mud)
+int mud_send (struct mud *mud, const void *data, size_t size, int tc)
 {
-    if (!mud)
-        return;
+    mud_send_ctrl(mud);
 
-    while (mud->path) {
-        struct path *path = mud->path;
-        mud->path = path->next;
-        free(path);
-    }
+    unsigned char packet[2048];
 
-    if (mud->fd != -1) {
-        int err = errno;
-        close(mud->fd);
-        errno = err;
-    }
+    mud_lock(mud, 0);
+    int ret = mud_send_data(mud, mud->session, packet, sizeof(packet),
+                            data, size, tc);
+    mud_unlock(mud);
 
-    free(mud);
+    mud_flush(mud);
+
+    return ret;
 }
 
-static
-int mud_encrypt (struct mud *mud, uint64_t nonce,
-                 unsigned char *dst, size_t dst_size,
-                 const unsigned char *src, size_t src_size)
+int mud_send_inplace (struct mud *mud, void *buf, size_t size, int tc)
 {
-    if (!nonce)
-        return 0;
+    if (!buf) {
+        errno = EINVAL;
+        return -1;
+    }
 
-    size_t size = src_size+MUD_PACKET_MIN_SIZE;
+    mud_send_ctrl(mud);
 
-    if (size > dst_size)
-        return 0;
+    mud_lock(mud, 0);
 
-    struct crypto_opt opt = {
-        .dst = dst+MUD_U48_SIZE,
-        .src = { .data = src,
-                 .size = src_size },
-        .ad  = { .data = dst,
-                 .size = MUD_U48_SIZE },
-    };
+    size_t hdr_size = mud_header_size(mud, mud->session);
+    unsigned char *packet = (unsigned char *)buf+MUD_HEADROOM-hdr_size;
 
-    mud_write48(opt.npub, nonce);
-    memcpy(dst, opt.npub, MUD_U48_SIZE);
+    int ret = mud_send_data(mud, mud->session,
+                            packet, size+hdr_size+MUD_MAC_SIZE,
+                            packet+hdr_size, size, tc);
+    mud_unlock(mud);
 
-    if (mud->crypto.use_next) {
-        mud_encrypt_opt(&mud->crypto.next, &opt);
-    } else {
-        mud_encrypt_opt(&mud->crypto.current, &opt);
-    }
+    mud_flush(mud);
 
-    return size;
+    return ret;
 }
 
 static
-int mud_decrypt (struct mud *mud,
-                 unsigned char *dst, size_t dst_size,
-                 const unsigned char *src, size_t src_size)
+unsigned mud_send_build (struct mud *mud, struct tx *tx, struct path *path,
+                         struct mud_packet *packet, unsigned k,
+                         unsigned i, unsigned n)
 {
-    size_t size = src_size-MUD_PACKET_MIN_SIZE;
+    for (; i < n; k++) {
+        unsigned j = i+1;
 
-    if (size > dst_size)
-        return 0;
+#if defined MUD_GSO
+        if (MUD_LOAD(mud->gso)) {
+            size_t size = tx->iov[i].iov_len;
 
-    struct crypto_opt opt = {
-        .dst = dst,
-        .src = { .data = src+MUD_U48_SIZE,
-                 .size = src_size-MUD_U48_SIZE },
-        .ad  = { .data = src,
-                 .size = MUD_U48_SIZE },
-    };
+            while ((j < n) && (tx->iov[j].iov_len <= size) &&
+                   (packet[tx->index[j]].tc == packet[tx->index[i]].tc)) {
+                if (tx->iov[j++].iov_len < size)
+                    break;
+            }
+        }
+#endif
+
+        unsigned char *ctrl = tx->ctrl[k];
+        size_t ctrl_size;
 
-    memcpy(opt.npub, src, MUD_U48_SIZE);
+        if (path->conn.fd == -1) {
+            ctrl_size = path->ctrl.size;
+            memcpy(ctrl, path->ctrl.data, ctrl_size);
 
-    if (mud_decrypt_opt(&mud->crypto.current, &opt)) {
-        if (!mud_decrypt_opt(&mud->crypto.next, &opt)) {
-            mud_keyx_init(mud);
-            mud->crypto.last = mud->crypto.current;
-            mud->crypto.current = mud->crypto.next;
-            mud->crypto.use_next = 0;
+            if (path->tc)
+                memcpy(ctrl+(path->tc-path->ctrl.data),
+                       &packet[tx->index[i]].tc, sizeof(int));
         } else {
-            if (mud_decrypt_opt(&mud->crypto.last, &opt) &&
-                mud_decrypt_opt(&mud->crypto.private, &opt))
-                return -1;
+            ctrl_size = mud_conn_ctrl(path, ctrl, packet[tx->index[i]].tc);
         }
-    }
 
-    return size;
-}
-
-static
-int mud_localaddr (struct ipaddr *local_addr, struct msghdr *msg, int family)
-{
-    int cmsg_level = IPPROTO_IP;
-    int cmsg_type = MUD_PKTINFO;
+#if defined MUD_GSO
+        if (j-i > 1) {
+            struct cmsghdr *cmsg = (struct cmsghdr *)(ctrl+ctrl_size);
+            uint16_t gso_size = (uint16_t)tx->iov[i].iov_len;
 
-    if (family == AF_INET6) {
-        cmsg_level = IPPROTO_IPV6;
-        cmsg_type = IPV6_PKTINFO;
-    }
+            memset(cmsg, 0, CMSG_SPACE(sizeof(gso_size)));
 
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+            cmsg->cmsg_level = IPPROTO_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
 
-    for (; cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
-        if ((cmsg->cmsg_level == cmsg_level) &&
-            (cmsg->cmsg_type == cmsg_type))
-            break;
-    }
+            memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+            ctrl_size += CMSG_SPACE(sizeof(gso_size));
+        }
+#endif
 
-    if (!cmsg)
-        return 1;
+        tx->msg[k].msg_hdr = (struct msghdr) {
+            .msg_iov = &tx->iov[i],
+            .msg_iovlen = j-i,
+            .msg_control = ctrl_size ? ctrl : NULL,
+            .msg_controllen = ctrl_size,
+        };
 
-    local_addr->family = family;
+        if (path->conn.fd == -1) {
+            tx->msg[k].msg_hdr.msg_name = &path->addr;
+            tx->msg[k].msg_hdr.msg_namelen = mud_addrlen(&path->addr);
+        }
 
-    if (family == AF_INET) {
-        memcpy(&local_addr->ip.v4,
-               MUD_PKTINFO_SRC(CMSG_DATA(cmsg)),
-               sizeof(struct in_addr));
-    } else {
-        memcpy(&local_addr->ip.v6,
-               &((struct in6_pktinfo *)CMSG_DATA(cmsg))->ipi6_addr,
-               sizeof(struct in6_addr));
+        tx->count[k] = j-i;
+        i = j;
     }
 
-    return 0;
+    return k;
 }
 
 static
-void mud_ctrl_path (struct mud *mud, enum mud_msg msg, struct path *path,
-                    uint64_t now)
+void mud_send_result (struct tx *tx, struct path *path,
+                      struct mud_packet *packet, unsigned i, int ret)
 {
-    struct {
-        unsigned char zero[MUD_U48_SIZE];
-        unsigned char time[MUD_U48_SIZE];
-        unsigned char data[128+MUD_MAC_SIZE];
-    } ctrl;
+    unsigned j = tx->index[i];
 
-    size_t size = 0;
-
-    memset(ctrl.zero, 0, MUD_U48_SIZE);
-    mud_write48(ctrl.time, now);
-
-    switch (msg) {
-    case mud_pong:
-        mud_write48(ctrl.data, path->sdt);
-        mud_write48(&ctrl.data[MUD_U48_SIZE], path->rdt);
-        mud_write48(&ctrl.data[2*MUD_U48_SIZE], path->rst);
-        size = MUD_U48_SIZE*3;
-        break;
-    case mud_keyx:
-        memcpy(ctrl.data, &mud->crypto.public, sizeof(mud->crypto.public));
-        size = sizeof(mud->crypto.public);
-        break;
-    case mud_mtux:
-        mud_write48(ctrl.data, (uint64_t)mud->mtu.local);
-        size = MUD_U48_SIZE;
-        break;
-    case mud_bakx:
-        ctrl.data[0] = (unsigned char)path->bak.local;
-        size = 1;
-        break;
-    }
-
-    struct crypto_opt opt = {
-        .dst = ctrl.data+size,
-        .ad  = { .data = ctrl.zero,
-                 .size = size+2*MUD_U48_SIZE },
-    };
-
-    size += 2*MUD_U48_SIZE+MUD_MAC_SIZE;
-
-    mud_encrypt_opt(&mud->crypto.private, &opt);
-    mud_send_path(mud, path, now, &ctrl, size, 0);
+    if (tx->path[j] == path)
+        packet[j].ret = ret;
 }
 
 static
-void mud_recv_keyx (struct mud *mud, struct path *path, uint64_t now,
-                    unsigned char *data)
+void mud_send_group (struct mud *mud, struct tx *tx, struct sched *sched,
+                     int fd, uint64_t now, struct mud_packet *packet,
+                     unsigned count)
 {
-    struct crypto_key *key = &mud->crypto.next;
+    struct path *path = sched->path;
+    unsigned i, n = 0;
 
-    struct {
-        unsigned char secret[crypto_scalarmult_BYTES];
-        struct public public;
-    } shared_send, shared_recv;
+    for (i = 0; i < count; i++) {
+        if ((!tx->size[i]) ||
+            ((tx->path[i] != path) && (!sched->probe)))
+            continue;
 
-    memcpy(&shared_recv.public, data, sizeof(shared_recv.public));
+        tx->iov[n].iov_base = tx->data[i];
+        tx->iov[n].iov_len = tx->size[i];
+        tx->index[n++] = i;
+    }
 
-    int sync_send = memcmp(shared_recv.public.recv, mud->crypto.public.send,
-                           sizeof(shared_recv.public.recv));
+    unsigned m = mud_send_build(mud, tx, path, packet, 0, 0, n);
+    unsigned done = 0;
 
-    int sync_recv = memcmp(mud->crypto.public.recv, shared_recv.public.send,
-                           sizeof(mud->crypto.public.recv));
+    if (path->conn.fd != -1)
+        fd = path->conn.fd;
 
-    memcpy(shared_recv.public.recv, mud->crypto.public.send,
-           sizeof(shared_recv.public.recv));
+    for (i = 0; done < m;) {
+        int ret = mud_sendmmsg(mud, fd, path, &tx->msg[done], m-done);
 
-    memcpy(mud->crypto.public.recv, shared_recv.public.send,
-           sizeof(mud->crypto.public.recv));
+        if (ret == -1) {
+            unsigned c = tx->count[done];
 
-    mud->crypto.use_next = !sync_send;
+            if ((c > 1) && ((errno == EIO) || (errno == EINVAL))) {
+                MUD_STORE(mud->gso, 0);
+                m = mud_send_build(mud, tx, path, packet, done, i, n);
+                continue;
+            }
 
-    if (sync_send)
-        mud_ctrl_path(mud, mud_keyx, path, now);
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                while (i < n)
+                    mud_send_result(tx, path, packet, i++, -1);
+                break;
+            }
 
-    if (crypto_scalarmult(shared_recv.secret, mud->crypto.secret,
-                          shared_recv.public.send))
-        return;
+            while (c--)
+                mud_send_result(tx, path, packet, i++, -1);
 
-    memcpy(shared_send.secret, shared_recv.secret,
-           sizeof(shared_send.secret));
+            done++;
+            continue;
+        }
 
-    memcpy(shared_send.public.send, shared_recv.public.recv,
-           sizeof(shared_send.public.send));
+        for (; ret > 0; ret--, done++) {
+            unsigned c = tx->count[done];
 
-    memcpy(shared_send.public.recv, shared_recv.public.send,
-           sizeof(shared_send.public.recv));
+            while (c--) {
+                mud_send_result(tx, path, packet, i, (int)tx->iov[i].iov_len);
+                i++;
+            }
+        }
 
-    crypto_generichash(key->encrypt.key, MUD_KEY_SIZE,
-                       (unsigned char *)&shared_send, sizeof(shared_send),
-                       mud->crypto.private.encrypt.key, MUD_KEY_SIZE);
+        MUD_STORE(path->limit, sched->limit);
+        MUD_STORE(path->send_time, now);
+    }
+}
 
-    crypto_generichash(key->decrypt.key, MUD_KEY_SIZE,
-                       (unsigned char *)&shared_recv, sizeof(shared_recv),
-                       mud->crypto.private.encrypt.key, MUD_KEY_SIZE);
+static
+int mud_send_chunk (struct mud *mud, struct tx *tx, int fd,
+                    struct session *session,
+                    struct mud_packet *packet, unsigned count)
+{
+    uint64_t now = mud_now(mud);
+    size_t mtu = (size_t)mud_mtu(mud, session);
+    struct crypto_key *key = mud_encrypt_key(session);
+    struct crypto_opt opt[MUD_BATCH_SIZE];
+    unsigned i, n = 0;
 
-    key->aes = (shared_recv.public.send[MUD_PKEY_SIZE-1] == 1) &&
-               (shared_recv.public.recv[MUD_PKEY_SIZE-1] == 1);
+    for (i = 0; i < count; i++) {
+        packet[i].ret = 0;
+        tx->size[i] = 0;
+        tx->path[i] = NULL;
 
-    if (key->aes) {
-        crypto_aead_aes256gcm_beforenm(&key->encrypt.state, key->encrypt.key);
-        crypto_aead_aes256gcm_beforenm(&key->decrypt.state, key->decrypt.key);
-    }
+        if (!packet[i].size)
+            continue;
 
-    mud->crypto.recv_time = now;
-}
+        if (packet[i].size > mtu) {
+            packet[i].ret = -1;
+            errno = EMSGSIZE;
+            continue;
+        }
 
-int mud_recv (struct mud *mud, void *data, size_t size)
-{
-    unsigned char packet[MUD_PACKET_MAX_SIZE];
+        n++;
+    }
 
-    struct iovec iov = {
-        .iov_base = packet,
-        .iov_len = sizeof(packet),
-    };
+    if (!n)
+        return 0;
 
-    struct sockaddr_storage addr;
-    unsigned char ctrl[256];
+    uint64_t nonce = mud_nonce(mud, session, key, now, n);
 
-    struct msghdr msg = {
-        .msg_name = &addr,
-        .msg_namelen = sizeof(addr),
-        .msg_iov = &iov,
-        .msg_iovlen = 1,
-        .msg_control = ctrl,
-        .msg_controllen = sizeof(ctrl),
-    };
+    n = 0;
 
-    ssize_t packet_size = recvmsg(mud->fd, &msg, 0);
+    for (i = 0; i < count; i++) {
+        if ((!packet[i].size) || (packet[i].ret))
+            continue;
 
-    if (packet_size <= (ssize_t)MUD_PACKET_MIN_SIZE)
-        return -(packet_size == (ssize_t)-1);
+        int size = 0;
 
-    uint64_t now = mud_now(mud);
-    uint64_t send_time = mud_read48(packet);
+        if (nonce)
+            size = mud_encrypt_header(mud, session, key, now, nonce+n,
+                                      tx->data[i], sizeof(tx->data[i]),
+                                      packet[i].data, packet[i].size, &opt[n]);
 
-    int mud_packet = !send_time;
+        if (!size) {
+            packet[i].ret = -1;
 
-    if (mud_packet) {
-        if (packet_size < (ssize_t)MUD_PACKET_SIZEOF(MUD_U48_SIZE))
-            return 0;
+            if (nonce)
+                errno = EINVAL;
+            continue;
+        }
 
-        send_time = mud_read48(&packet[MUD_U48_SIZE]);
+        tx->size[i] = (size_t)size;
+        n++;
     }
 
-    if (mud_abs_diff(now, send_time) >= mud->time_tolerance)
+    if (!n)
         return 0;
 
-    if (mud_packet) {
-        unsigned char tmp[sizeof(packet)];
+    mud_encrypt_opts(mud, key, opt, n);
+    mud_sched_init(mud, tx, session, now);
 
-        struct crypto_opt opt = {
-            .dst = tmp,
-            .src = { .data = packet+packet_size-MUD_MAC_SIZE,
-                     .size = MUD_MAC_SIZE },
-            .ad  = { .data = packet,
-                     .size = packet_size-MUD_MAC_SIZE },
-        };
+    struct sched *sched_bak = NULL;
+    size_t j;
 
-        if (mud_decrypt_opt(&mud->crypto.private, &opt))
-            return 0;
-    }
+    for (j = 0; j < tx->sched.count; j++) {
+        struct sched *sched = &tx->sched.data[j];
 
-    mud_unmapv4((struct sockaddr *)&addr);
+        if (sched->path->bak.local) {
+            if (!sched_bak)
+                sched_bak = sched;
+            sched->limit = INT64_MAX;
+        } else if (sched->probe) {
+            sched->count = 1;
+        }
+    }
 
-    struct ipaddr local_addr;
+    for (i = 0; i < count; i++) {
+        if (!tx->size[i])
+            continue;
 
-    if (mud_localaddr(&local_addr, &msg, addr.ss_family))
-        return 0;
+        struct sched *sched_min = NULL;
+        int64_t limit_min = INT64_MAX;
 
-    struct path *path = mud_path(mud, &local_addr,
-                                 (struct sockaddr *)&addr, mud_packet);
+        for (j = 0; j < tx->sched.count; j++) {
+            struct sched *sched = &tx->sched.data[j];
 
-    if (!path)
-        return 0;
+            if ((sched->probe) || (sched->path->bak.local))
+                continue;
 
-    if (path->rdt) {
-        path->rdt = ((now-path->recv_time)+UINT64_C(7)*path->rdt)/UINT64_C(8);
-        path->sdt = ((send_time-path->rst)+UINT64_C(7)*path->sdt)/UINT64_C(8);
-    } else if (path->recv_time) {
-        path->rdt = now-path->recv_time;
-        path->sdt = send_time-path->rst;
-    }
+            int64_t limit = sched->limit;
 
-    path->rst = send_time;
+            if (sched->count)
+                limit += sched->path->rtt/2;
 
-    if ((!path->bak.local) && (path->recv_time) &&
-        (mud_timeout(now, path->pong_time, MUD_PONG_TIMEOUT))) {
-        mud_ctrl_path(mud, mud_pong, path, now);
-        path->pong_time = now;
-    }
+            if (limit_min > limit) {
+                limit_min = limit;
+                sched_min = sched;
+            }
+        }
 
-    path->recv_time = now;
+        if (sched_min) {
+            sched_min->limit = limit_min;
+        } else {
+            sched_min = sched_bak;
+        }
 
-    if (mud_packet) {
-        if (packet_size == (ssize_t)MUD_KEYX_SIZE) {
-            mud_recv_keyx(mud, path, now, &packet[MUD_U48_SIZE*2]);
-        } else if (packet_size == (ssize_t)MUD_MTUX_SIZE) {
-            mud->mtu.remote = (int)mud_read48(&packet[MUD_U48_SIZE*2]);
-            if (!path->state.active)
-                mud_ctrl_path(mud, mud_mtux, path, now);
-        } else if (packet_size == (ssize_t)MUD_PONG_SIZE) {
-            path->r_sdt = mud_read48(&packet[MUD_U48_SIZE*2]);
-            path->r_rdt = mud_read48(&packet[MUD_U48_SIZE*3]);
-            path->r_rst = mud_read48(&packet[MUD_U48_SIZE*4]);
-            path->r_dt = send_time-path->r_rst;
-            path->rtt = now-path->r_rst;
-        } else if (packet_size == (ssize_t)MUD_BAKX_SIZE) {
-            path->bak.local = 1;
-            path->bak.remote = (int)packet[MUD_U48_SIZE*2];
-            if (!path->state.active)
-                mud_ctrl_path(mud, mud_bakx, path, now);
+        if (sched_min) {
+            tx->path[i] = sched_min->path;
+            sched_min->count++;
         }
-        return 0;
     }
 
-    int ret = mud_decrypt(mud, data, size, packet, packet_size);
+    for (j = 0; j < tx->sched.count; j++) {
+        if (tx->sched.data[j].count)
+            mud_send_group(mud, tx, &tx->sched.data[j], fd, now, packet, count);
+    }
 
-    if (ret == -1) {
-        mud->crypto.bad_key = 1;
-        return 0;
+    int ret = 0;
+
+    for (i = 0; i < count; i++) {
+        if (packet[i].ret > 0)
+            ret++;
     }
 
     return ret;
 }
 
-int mud_send_ctrl (struct mud *mud)
+static
+int mud_send_lane (struct mud *mud, struct tx *tx, int fd,
+                   struct mud_packet *packet, unsigned count)
 {
-    struct path *path;
+    int ret = 0;
 
-    for (path = mud->path; path; path = path->next) {
-        uint64_t now = mud_now(mud);
+    while (count) {
+        unsigned max = (count < MUD_BATCH_SIZE) ? count : MUD_BATCH_SIZE;
+        unsigned n = 1;
 
-        if (!path->state.active) {
-            if ((mud->crypto.bad_key) &&
-                (mud_timeout(now, mud->crypto.send_time, mud->send_timeout))) {
-                mud_ctrl_path(mud, mud_keyx, path, now);
-                mud->crypto.send_time = now;
-                mud->crypto.bad_key = 0;
-            }
-        } else {
-            if ((mud_timeout(now, mud->crypto.send_time, mud->send_timeout)) &&
-                (mud_timeout(now, mud->crypto.recv_time, MUD_KEYX_TIMEOUT))) {
-                mud_ctrl_path(mud, mud_keyx, path, now);
-                mud->crypto.send_time = now;
-                continue;
-            }
+        while ((n < max) && (packet[n].session == packet[0].session))
+            n++;
 
-            if ((!mud->mtu.remote) &&
-                (mud_timeout(now, mud->mtu.send_time, mud->send_timeout))) {
-                mud_ctrl_path(mud, mud_mtux, path, now);
-                mud->mtu.send_time = now;
-                continue;
-            }
+        struct session *session = mud->session;
 
-            if ((path->bak.local && !path->bak.remote) &&
-                (mud_timeout(now, path->bak.send_time, mud->send_timeout))) {
-                mud_ctrl_path(mud, mud_bakx, path, now);
-                path->bak.send_time = now;
-                continue;
-            }
+        if (mud->sessions.enabled)
+            session = mud_session(mud, packet[0].session);
 
-            if (!path->send_time)
-                mud_ctrl_path(mud, mud_ping, path, now);
-        }
-    }
-}
+        if (session) {
+            ret += mud_send_chunk(mud, tx, fd, session, packet, n);
+        } else {
+            unsigned i;
 
-int mud_send (struct mud *mud, const void *data, size_t size, int tc)
-{
-    mud_send_ctrl(mud);
+            for (i = 0; i < n; i++)
+                packet[i].ret = -1;
 
-    if (!size)
-        return 0;
+            errno = ENOENT;
+        }
 
-    if (size > (size_t)mud_get_mtu(mud)) {
-        errno = EMSGSIZE;
-        return -1;
+        packet += n;
+        count -= n;
     }
 
-    uint64_t now = mud_now(mud);
-    unsigned char packet[2048];
-
-    int packet_size = mud_encrypt(mud, now, packet, sizeof(packet), data, size);
+    return ret;
+}
 
-    if (!packet_size) {
+int mud_send_batch (struct mud *mud, struct mud_packet *packet, unsigned count)
+{
+    if (!packet) {
         errno = EINVAL;
         return -1;
     }
 
-    struct path *path;
-    struct path *path_min = NULL;
-    int64_t limit_min = INT64_MAX;
+    mud_send_ctrl(mud);
+    mud_lock(mud, 0);
 
-    for (path = mud->path; path; path = path->next) {
-        if (path->bak.local)
-            continue;
+    int ret = mud_send_lane(mud, &mud->tx, mud->fd, packet, count);
 
-        int64_t limit = path->limit;
-        uint64_t elapsed = now-path->send_time;
+    mud_unlock(mud);
+    mud_flush(mud);
 
-        if (limit > elapsed) {
-            limit += path->rtt/2-elapsed;
-        } else {
-            limit = path->rtt/2;
-        }
+    return ret;
+}
 
-        if (mud_timeout(now, path->recv_time, mud->send_timeout)) {
-            mud_send_path(mud, path, now, packet, packet_size, tc);
-            path->limit = limit;
-            continue;
-        }
+int mud_send_shard (struct mud *mud, unsigned shard,
+                    struct mud_packet *packet, unsigned count)
+{
+    if (!shard)
+        return mud_send_batch(mud, packet, count);
 
-        if (limit_min > limit) {
-            limit_min = limit;
-            path_min = path;
-        }
+    if (!packet || (shard >= mud->shard.count)) {
+        errno = EINVAL;
+        return -1;
     }
 
-    if (!path_min) {
-        for (path = mud->path; path; path = path->next) {
-            if (path->bak.local) {
-                path_min = path;
-                break;
-            }
-        }
+    struct shard *s = &mud->shard.data[shard-1];
 
-        if (!path_min)
-            return 0;
-    }
+    mud_send_ctrl(mud);
+    mud_lock(mud, 0);
 
-    ssize_t ret = mud_send_path(mud, path_min, now, packet, packet_size, tc);
+    int ret = mud_send_lane(mud, &s->tx, s->fd, packet, count);
 
-    if (ret == packet_size)
-        path_min->limit = limit_min;
+    mud_unlock(mud);
 
-    return (int)ret;
+    return ret;
 }
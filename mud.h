@@ -1,24 +1,102 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+
+#define MUD_HEADROOM 16
+#define MUD_TAILROOM 16
 
 struct mud;
 
-struct mud *mud_create (int, int, int, int, int);
-void        mud_delete (struct mud *);
+struct mud_packet {
+    void    *data;
+    size_t   size;
+    int      tc;
+    int      ret;
+    unsigned session;
+};
+
+struct mud_datagram {
+    void            *data;
+    size_t           size;
+    void            *ctrl;
+    size_t           ctrl_size;
+    struct sockaddr *addr;
+    struct sockaddr *local;
+};
+
+struct mud_stats {
+    uint64_t rx_packets;
+    uint64_t rx_data;
+    uint64_t rx_ctrl;
+    uint64_t drop_size;
+    uint64_t drop_time;
+    uint64_t drop_path;
+    uint64_t drop_session;
+    uint64_t drop_rate;
+    uint64_t drop_auth;
+    uint64_t aead;
+    uint64_t path_created;
+    uint64_t path_expired;
+    uint64_t path_evicted;
+    uint64_t path_rebound;
+    uint64_t pool_tasks;
+    uint64_t pool_queue_ns;
+    uint64_t pool_run_ns;
+    uint64_t pool_wait_ns;
+};
+
+struct mud *mud_create        (int, int, int, int, int);
+struct mud *mud_create_shards (int, int, int, int, int, unsigned);
+void        mud_delete        (struct mud *);
 
-int mud_get_fd  (struct mud *);
+int mud_get_fd       (struct mud *);
+int mud_get_shard_fd (struct mud *, unsigned);
 
 int mud_set_key (struct mud *, unsigned char *, size_t);
 int mud_get_key (struct mud *, unsigned char *, size_t *);
 
+int mud_set_session (struct mud *, unsigned);
+int mud_add_session (struct mud *, unsigned, unsigned char *, size_t);
+int mud_del_session (struct mud *, unsigned);
+int mud_set_conn_id (struct mud *, int);
+
 int mud_set_mtu (struct mud *, int mtu);
 int mud_get_mtu (struct mud *);
 
 int mud_set_send_timeout_msec  (struct mud *, unsigned);
 int mud_set_time_tolerance_sec (struct mud *, unsigned);
+int mud_set_nonce_counter      (struct mud *, int);
+int mud_set_key_epoch          (struct mud *, int);
+int mud_set_aegis              (struct mud *, int);
+int mud_set_filter_rate        (struct mud *, unsigned);
+int mud_set_path_max           (struct mud *, unsigned);
+int mud_set_path_idle_sec      (struct mud *, unsigned);
+int mud_set_crypto_workers     (struct mud *, unsigned);
+
+int mud_get_stats (struct mud *, struct mud_stats *);
+
+int mud_set_gso (struct mud *, int);
+int mud_set_gro (struct mud *, int);
+int mud_set_io_uring (struct mud *, int);
+int mud_set_connect (struct mud *, int);
+int mud_set_io_queue (struct mud *, int);
+int mud_set_clock (struct mud *, uint64_t);
 
 int mud_peer (struct mud *, const char *, const char *, int, int);
 
+int mud_next_timeout   (struct mud *);
+int mud_process_timers (struct mud *);
+
 int mud_recv (struct mud *, void *, size_t);
+int mud_recv_batch (struct mud *, struct mud_packet *, unsigned);
+int mud_recv_view (struct mud *, struct mud_packet *, unsigned);
+int mud_recv_frame (struct mud *, void *, size_t, void *, size_t);
+int mud_recv_shard (struct mud *, unsigned, struct mud_packet *, unsigned);
 int mud_send (struct mud *, const void *, size_t, int);
+int mud_send_inplace (struct mud *, void *, size_t, int);
+int mud_send_batch (struct mud *, struct mud_packet *, unsigned);
+int mud_send_shard (struct mud *, unsigned, struct mud_packet *, unsigned);
+int mud_send_frame (struct mud *, const void *, size_t, int, void *, size_t);
+int mud_input (struct mud *, uint64_t, struct mud_datagram *, struct mud_packet *, unsigned);
+int mud_output (struct mud *, struct mud_datagram *, unsigned);
@@ -0,0 +1,121 @@
+// cc -I. test/evict.c mud.c -lsodium -lpthread -o evict && ./evict
+
+#include "mud.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+
+#define COUNT 16
+
+static unsigned char keyx[1500], mtux[1500];
+static size_t keyx_size, mtux_size;
+static struct sockaddr_storage local;
+
+static int
+grab(struct mud *mud, unsigned char *data, size_t *size)
+{
+    struct mud_datagram out[16];
+    int n = mud_output(mud, out, 16);
+
+    if (n != 1)
+        return -1;
+
+    memcpy(data, out[0].data, out[0].size);
+    memcpy(&local, out[0].addr, sizeof(struct sockaddr_in));
+    *size = out[0].size;
+
+    return 0;
+}
+
+static void
+input(struct mud *mud, uint64_t now, unsigned char *data, size_t size,
+      unsigned short port)
+{
+    static unsigned char buf[1500];
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    struct mud_datagram in = {
+        .data = data,
+        .size = size,
+        .addr = (struct sockaddr *)&addr,
+        .local = (struct sockaddr *)&local,
+    };
+    struct mud_packet packet = {
+        .data = buf,
+        .size = sizeof(buf),
+    };
+    struct mud_datagram out[16];
+
+    mud_input(mud, now, &in, &packet, 1);
+    mud_output(mud, out, 16);
+}
+
+int
+main(void)
+{
+    struct mud *a = mud_create(20130, 1, 0, 0, 1400);
+    struct mud *b = mud_create(20131, 1, 0, 0, 1400);
+    unsigned char key[32];
+    size_t size = sizeof(key);
+    uint64_t now = UINT64_C(1) << 40;
+
+    if (!a || !b) {
+        perror("mud_create");
+        return 1;
+    }
+    mud_get_key(a, key, &size);
+    mud_set_key(b, key, size);
+
+    if (mud_set_io_queue(a, 1) || mud_set_io_queue(b, 1) ||
+        mud_set_clock(a, now) || mud_set_clock(b, now) ||
+        mud_set_path_max(b, 1) ||
+        mud_peer(a, "127.0.0.1", "127.0.0.1", 20131, 0)) {
+        perror("setup");
+        return 1;
+    }
+    mud_process_timers(b);
+
+    mud_process_timers(a);
+    if (grab(a, keyx, &keyx_size)) {
+        fprintf(stderr, "no keyx from a\n");
+        return 1;
+    }
+    now += 1000;
+    mud_set_clock(a, now);
+    mud_set_clock(b, now);
+
+    mud_process_timers(a);
+    if (grab(a, mtux, &mtux_size)) {
+        fprintf(stderr, "no mtux from a\n");
+        return 1;
+    }
+    input(b, now, keyx, keyx_size, 30000);
+
+    for (int i = 1; i <= COUNT; i++)
+        input(b, now, mtux, mtux_size, (unsigned short)(30000+i));
+
+    struct mud_stats stats;
+    mud_get_stats(b, &stats);
+
+    if (stats.path_evicted != COUNT) {
+        fprintf(stderr, "evicted %llu/%d paths\n",
+                (unsigned long long)stats.path_evicted, COUNT);
+        return 1;
+    }
+    struct mud_datagram out[16];
+
+    mud_process_timers(b);
+    int n = mud_output(b, out, 16);
+
+    printf("evicted %d paths with a keyx pending, sent %d\n", COUNT, n);
+
+    mud_delete(a);
+    mud_delete(b);
+
+    return n != 0;
+}
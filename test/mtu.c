@@ -0,0 +1,104 @@
+// cc -I. test/mtu.c mud.c -lsodium -lpthread -o mtu && ./mtu
+
+#include "mud.h"
+
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define COUNT 150
+
+static int
+ready(struct mud *mud, int timeout)
+{
+    struct pollfd pfd = {
+        .fd = mud_get_fd(mud),
+        .events = POLLIN,
+    };
+
+    return poll(&pfd, 1, timeout) > 0;
+}
+
+static int
+drain(struct mud *mud, unsigned char *buf, size_t size)
+{
+    int got = 0;
+
+    while (ready(mud, 0)) {
+        if (mud_recv(mud, buf, size) == (int)size)
+            got++;
+    }
+    return got;
+}
+
+static int
+run(int port, int ctr, int epoch)
+{
+    struct mud *a = mud_create(port, 1, 0, 0, 1400);
+    struct mud *b = mud_create(port+1, 1, 0, 0, 1400);
+    unsigned char key[32];
+    size_t size = sizeof(key);
+
+    if (!a || !b) {
+        perror("mud_create");
+        return 1;
+    }
+    mud_get_key(a, key, &size);
+    mud_set_key(b, key, size);
+
+    if (mud_peer(a, "127.0.0.1", "127.0.0.1", port+1, 0) ||
+        mud_peer(b, "127.0.0.1", "127.0.0.1", port, 0)) {
+        perror("mud_peer");
+        return 1;
+    }
+    if (mud_set_nonce_counter(a, ctr) || mud_set_nonce_counter(b, ctr) ||
+        mud_set_key_epoch(a, epoch) || mud_set_key_epoch(b, epoch)) {
+        perror("mud_set");
+        return 1;
+    }
+    static unsigned char buf[2][1500];
+
+    for (int i = 0; i < 100; i++) {
+        mud_process_timers(a);
+        mud_process_timers(b);
+        mud_send(a, "ping", 4, 0);
+        mud_send(b, "pong", 4, 0);
+        ready(b, 2);
+        drain(b, buf[1], sizeof(buf[1]));
+        drain(a, buf[1], sizeof(buf[1]));
+    }
+    int mtu = mud_get_mtu(a);
+    int got = 0;
+
+    memset(buf[0], 'x', sizeof(buf[0]));
+
+    for (int i = 0; i < COUNT; i++) {
+        if (mud_send(a, buf[0], (size_t)mtu, 0) <= 0) {
+            perror("mud_send");
+            return 1;
+        }
+        ready(b, 20);
+        got += drain(b, buf[1], (size_t)mtu);
+    }
+    while (ready(b, 50))
+        got += drain(b, buf[1], (size_t)mtu);
+
+    printf("ctr %d epoch %d: mtu %d got %d/%d\n", ctr, epoch, mtu, got, COUNT);
+
+    mud_delete(a);
+    mud_delete(b);
+
+    return got != COUNT;
+}
+
+int
+main(void)
+{
+    alarm(20);
+
+    return run(20120, 0, 0) |
+           run(20122, 1, 0) |
+           run(20124, 0, 1) |
+           run(20126, 1, 1);
+}
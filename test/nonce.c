@@ -0,0 +1,129 @@
+// cc -I. test/nonce.c mud.c -lsodium -lpthread -o nonce && ./nonce
+
+#include "mud.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+static uint64_t last;
+static unsigned long count;
+
+static uint64_t
+read48(const unsigned char *src)
+{
+    uint64_t ret = src[0];
+    ret |= ((uint64_t)src[1]) << 8;
+    ret |= ((uint64_t)src[2]) << 16;
+    ret |= ((uint64_t)src[3]) << 24;
+    ret |= ((uint64_t)src[4]) << 32;
+    ret |= ((uint64_t)src[5]) << 40;
+    return ret;
+}
+
+static int
+drain(struct mud *from, struct mud *to, uint64_t now, int check)
+{
+    struct mud_datagram out[64], in[64];
+    struct mud_packet packet[64];
+    unsigned char buf[64][1500];
+    int n;
+
+    while ((n = mud_output(from, out, 64)) > 0) {
+        for (int i = 0; i < n; i++) {
+            uint64_t nonce = read48(out[i].data);
+
+            if (check && nonce) {
+                if (nonce <= last) {
+                    fprintf(stderr, "nonce %llu after %llu (packet %lu)\n",
+                            (unsigned long long)nonce,
+                            (unsigned long long)last, count);
+                    return 1;
+                }
+                last = nonce;
+                count++;
+            }
+            in[i] = (struct mud_datagram){
+                .data = out[i].data,
+                .size = out[i].size,
+                .addr = out[i].local,
+                .local = out[i].addr,
+            };
+            packet[i] = (struct mud_packet){
+                .data = buf[i],
+                .size = sizeof(buf[i]),
+            };
+        }
+        if (to)
+            mud_input(to, now, in, packet, (unsigned)n);
+    }
+    return 0;
+}
+
+int
+main(void)
+{
+    struct mud *a = mud_create(20050, 1, 0, 0, 1400);
+    struct mud *b = mud_create(20051, 1, 0, 0, 1400);
+    unsigned char key[32];
+    size_t size = sizeof(key);
+    uint64_t now = UINT64_C(1) << 40;
+
+    if (!a || !b) {
+        perror("mud_create");
+        return 1;
+    }
+    mud_get_key(a, key, &size);
+    mud_set_key(b, key, size);
+
+    if (mud_set_io_queue(a, 1) || mud_set_io_queue(b, 1) ||
+        mud_set_time_tolerance_sec(a, 1) || mud_set_time_tolerance_sec(b, 1) ||
+        mud_set_clock(a, now) || mud_set_clock(b, now) ||
+        mud_peer(a, "127.0.0.1", "127.0.0.1", 20051, 0) ||
+        mud_peer(b, "127.0.0.1", "127.0.0.1", 20050, 0)) {
+        perror("setup");
+        return 1;
+    }
+    for (int i = 0; i < 200; i++) {
+        now += 10000;
+        mud_set_clock(a, now);
+        mud_set_clock(b, now);
+        mud_process_timers(a);
+        mud_process_timers(b);
+        mud_send(a, "x", 1, 0);
+        drain(a, b, now, 0);
+        drain(b, a, now, 0);
+    }
+    for (int round = 0; round < 2; round++) {
+        unsigned long sent = 0;
+
+        for (;;) {
+            int ret = mud_send(a, "x", 1, 0);
+
+            if (ret == -1) {
+                if (errno != EAGAIN) {
+                    perror("mud_send");
+                    return 1;
+                }
+                break;
+            }
+            if ((++sent & 127) == 0 && drain(a, NULL, now, 1))
+                return 1;
+        }
+        if (drain(a, NULL, now, 1))
+            return 1;
+        if (sent < 100000) {
+            fprintf(stderr, "window closed after %lu packets\n", sent);
+            return 1;
+        }
+        printf("round %d: %lu packets, last nonce %llu\n",
+               round, sent, (unsigned long long)last);
+        now += 2000000;
+        mud_set_clock(a, now);
+        mud_set_clock(b, now);
+    }
+    mud_delete(a);
+    mud_delete(b);
+    return 0;
+}
@@ -0,0 +1,147 @@
+// cc -I. test/rekey.c mud.c -lsodium -lpthread -o rekey && ./rekey
+
+#include "mud.h"
+
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ROUNDS 4
+#define BATCH  16
+#define COUNT  8
+
+#define ONE_MIN (60*UINT64_C(1000000))
+
+static int
+ready(struct mud *mud, int timeout)
+{
+    struct pollfd pfd = {
+        .fd = mud_get_fd(mud),
+        .events = POLLIN,
+    };
+
+    return poll(&pfd, 1, timeout) > 0;
+}
+
+static unsigned
+drain(struct mud *mud, int view, unsigned *bad)
+{
+    static char buf[BATCH][1500];
+    struct mud_packet packet[BATCH];
+    unsigned got = 0;
+
+    while (ready(mud, 0)) {
+        for (int i = 0; i < BATCH; i++) {
+            packet[i] = (struct mud_packet){
+                .data = buf[i],
+                .size = sizeof(buf[i]),
+            };
+        }
+        int ret = view ? mud_recv_view(mud, packet, BATCH)
+                       : mud_recv_batch(mud, packet, BATCH);
+
+        for (int i = 0; i < ret; i++) {
+            if (packet[i].size == 4)
+                continue;
+            if ((packet[i].size != 12) ||
+                (memcmp(packet[i].data, "seq ", 4)))
+                (*bad)++;
+            got++;
+        }
+    }
+    return got;
+}
+
+static int
+run(int port, int view, unsigned workers, int aegis)
+{
+    struct mud *a = mud_create(port, 1, 0, 0, 1400);
+    struct mud *b = mud_create(port+1, 1, 0, 0, 1400);
+    unsigned char key[32];
+    size_t size = sizeof(key);
+    uint64_t now = 1000*ONE_MIN;
+
+    if (!a || !b) {
+        perror("mud_create");
+        return 1;
+    }
+    mud_get_key(a, key, &size);
+    mud_set_key(b, key, size);
+
+    if (mud_peer(a, "127.0.0.1", "127.0.0.1", port+1, 0) ||
+        mud_peer(b, "127.0.0.1", "127.0.0.1", port, 0)) {
+        perror("mud_peer");
+        return 1;
+    }
+    if (workers && mud_set_crypto_workers(b, workers)) {
+        printf("skipped: no crypto workers\n");
+        return 0;
+    }
+    if (aegis && (mud_set_aegis(a, 1) || mud_set_aegis(b, 1))) {
+        printf("skipped: no AEGIS\n");
+        mud_delete(a);
+        mud_delete(b);
+        return 0;
+    }
+    char msg[BATCH][16];
+    struct mud_packet packet[BATCH];
+    unsigned sent = 0, got = 0, bad = 0;
+
+    for (int r = 0; r <= ROUNDS; r++) {
+        now += 61*ONE_MIN;
+        mud_set_clock(a, now);
+        mud_set_clock(b, now);
+
+        for (int i = 0; i < 50; i++) {
+            mud_process_timers(a);
+            mud_process_timers(b);
+            mud_send(a, "ping", 4, 0);
+            mud_send(b, "pong", 4, 0);
+            ready(b, 2);
+            drain(b, view, &bad);
+            drain(a, 0, &bad);
+        }
+        for (int k = 0; k < COUNT; k++) {
+            for (int i = 0; i < BATCH; i++) {
+                snprintf(msg[i], sizeof(msg[0]), "seq %08u", sent+i);
+                packet[i] = (struct mud_packet){
+                    .data = msg[i],
+                    .size = 12,
+                };
+            }
+            if (mud_send_batch(a, packet, BATCH) != BATCH) {
+                perror("mud_send_batch");
+                return 1;
+            }
+            sent += BATCH;
+            ready(b, 100);
+            got += drain(b, view, &bad);
+        }
+        while (ready(b, 50))
+            got += drain(b, view, &bad);
+    }
+    struct mud_stats stats;
+    mud_get_stats(b, &stats);
+
+    printf("%s%s: sent %u got %u bad %u auth %llu\n",
+           view ? "view" : workers ? "workers" : "batch",
+           aegis ? " aegis" : "",
+           sent, got, bad, (unsigned long long)stats.drop_auth);
+
+    mud_delete(a);
+    mud_delete(b);
+
+    return (bad || (got != sent) || stats.drop_auth) ? 1 : 0;
+}
+
+int
+main(void)
+{
+    alarm(20);
+
+    return run(20110, 0, 0, 0) |
+           run(20112, 1, 0, 0) |
+           run(20114, 0, 2, 0) |
+           run(20116, 1, 0, 1);
+}
@@ -0,0 +1,124 @@
+// cc -I. test/view.c mud.c -lsodium -lpthread -o view && ./view
+
+#include "mud.h"
+
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BATCH 8
+#define TOTAL 202
+
+static int
+ready(struct mud *mud, int timeout)
+{
+    struct pollfd pfd = {
+        .fd = mud_get_fd(mud),
+        .events = POLLIN,
+    };
+
+    return poll(&pfd, 1, timeout) > 0;
+}
+
+static int
+drop(struct mud *mud)
+{
+    struct mud_packet packet[8];
+    int got = 0;
+
+    while (ready(mud, 0)) {
+        int ret = mud_recv_view(mud, packet, 8);
+
+        if (ret > 0)
+            got += ret;
+    }
+    return got;
+}
+
+int
+main(void)
+{
+    struct mud *a = mud_create(20060, 1, 0, 0, 1400);
+    struct mud *b = mud_create(20061, 1, 0, 0, 1400);
+    unsigned char key[32];
+    size_t size = sizeof(key);
+
+    if (!a || !b) {
+        perror("mud_create");
+        return 1;
+    }
+    mud_get_key(a, key, &size);
+    mud_set_key(b, key, size);
+
+    if (mud_peer(a, "127.0.0.1", "127.0.0.1", 20061, 0) ||
+        mud_peer(b, "127.0.0.1", "127.0.0.1", 20060, 0)) {
+        perror("mud_peer");
+        return 1;
+    }
+    if (mud_set_gso(a, 1) || mud_set_gro(b, 1)) {
+        printf("skipped: no GSO/GRO\n");
+        return 0;
+    }
+    int up = 0;
+
+    for (int i = 0; (i < 500) && (up < 20); i++) {
+        mud_process_timers(a);
+        mud_process_timers(b);
+        mud_send(a, "ping", 4, 0);
+        mud_send(b, "pong", 4, 0);
+        ready(b, 2);
+        up += drop(b);
+        drop(a);
+    }
+    if (up < 20) {
+        fprintf(stderr, "no session\n");
+        return 1;
+    }
+    static const int batch[BATCH] = {17, 32, 23, 29, 32, 11, 26, 32};
+    char msg[TOTAL][16];
+    struct mud_packet packet[32];
+    unsigned sent = 0, got = 0, bad = 0;
+    int next = -1;
+
+    alarm(5);
+
+    for (int k = 0; (!bad) && ((k < BATCH) || (got < sent));) {
+        if ((k < BATCH) && (got+4 >= sent)) {
+            for (int i = 0; i < batch[k]; i++) {
+                snprintf(msg[sent+i], sizeof(msg[0]), "seq %08u", sent+i);
+                packet[i] = (struct mud_packet){
+                    .data = msg[sent+i],
+                    .size = 12,
+                };
+            }
+            if (mud_send_batch(a, packet, (unsigned)batch[k]) != batch[k]) {
+                perror("mud_send_batch");
+                return 1;
+            }
+            sent += (unsigned)batch[k++];
+            ready(b, 100);
+        }
+        int ret = mud_recv_view(b, packet, 4);
+
+        for (int i = 0; i < ret; i++) {
+            int seq;
+
+            if ((packet[i].size != 12) ||
+                (sscanf(packet[i].data, "seq %8d", &seq) != 1)) {
+                if (packet[i].size == 4)
+                    continue;
+                bad++;
+                continue;
+            }
+            if ((next != -1) && (seq != next))
+                bad++;
+            next = seq+1;
+            got++;
+        }
+    }
+    printf("sent %u got %u bad %u\n", sent, got, bad);
+    mud_delete(a);
+    mud_delete(b);
+    return (bad || !got) ? 1 : 0;
+}